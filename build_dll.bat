@@ -1,11 +1,22 @@
 @echo off
 
 if [%~1]==[] (
-    echo Usage: build_dll.bat ^<absolute_path_to_cpp^>
+    echo Usage: build_dll.bat ^<absolute_path_to_cpp^> ^<[optional]dll_name^> ^<[optional]mode: rel, deb, bench, pgi, pgo^> ^<[optional]arch: AVX2, AVX512^>
     exit /b 1
 )
 set process_abs_path=%1
 
+set dll_name=process_wrapper
+if not [%~2]==[] (set dll_name=%~2)
+
+rem rel: optimized, deb: debuggable, bench: rel without allocation counting (--tune's baseline),
+rem pgi: instrumented for profiling, pgo: optimized with the collected profile
+set mode=rel
+if not [%~3]==[] (set mode=%~3)
+
+set arch=
+if not [%~4]==[] (set arch=%~4)
+
 set build_dir=.\build_dll\
 
 if not exist %build_dir% (
@@ -14,30 +25,61 @@ if not exist %build_dir% (
 
 
 set lang_args=/std:c++20 /permissive- /openmp
-set file_args=/Fo%build_dir% /Fe%build_dir%
 set warn_args=/W3
-set common_args=%lang_args% %file_args% %warn_args%
+set common_args=%lang_args% %warn_args%
 
 set rel_args=/O2 /Ob3 /DEBUG:NO
+set bench_args=%rel_args% /DPROC_NO_ALLOC_STATS
 set deb_args=/Od /Ob1 /Zi /JMC /DEBUG:FASTLINK /Fd%build_dir%
-set common_args=%common_args% %deb_args%
+set pgo_args=/O2 /Ob3 /GL /DPROC_NO_ALLOC_STATS
+
+set link_args=/noimplib /noexp /incremental:no
+
+rem the profile is named after the optimized dll, the instrumented one is <dll_name>_pgi so it never replaces it
+set pgd_path=%build_dir%%dll_name%.pgd
+if %mode%==pgi (set dll_name=%dll_name%_pgi)
+
+if %mode%==rel (
+    set common_args=%common_args% %rel_args%
+) else if %mode%==bench (
+    set common_args=%common_args% %bench_args%
+) else if %mode%==deb (
+    set common_args=%common_args% %deb_args%
+    set link_args=%link_args% /debug:fastlink
+) else if %mode%==pgi (
+    set common_args=%common_args% %pgo_args%
+    set link_args=%link_args% /LTCG /GENPROFILE:PGD=%pgd_path%
+) else if %mode%==pgo (
+    set common_args=%common_args% %pgo_args%
+    set link_args=%link_args% /LTCG /USEPROFILE:PGD=%pgd_path%
+) else (
+    echo Unknown mode %mode%
+    exit /b 1
+)
+
+if not [%arch%]==[] (set common_args=%common_args% /arch:%arch%)
+
 
+rem Compile Precompiled Header, one per compile flags. The host deletes it when one of its headers changes
+set pch_name=%mode%
+if %mode%==pgi (set pch_name=pgo)
+if not [%arch%]==[] (set pch_name=%pch_name%_%arch%)
 
-rem Compile Precompiled Header
 if not exist %build_dir%pch.cpp (
     echo #include "process.hpp" > %build_dir%pch.cpp
 )
-if not exist %build_dir%.pch (
-    cl /nologo /c %common_args% ^
-    /Ycprocess.hpp /Fp%build_dir%.pch ^
+if not exist %build_dir%%pch_name%.pch (
+    cl /nologo /c %common_args% /Fo%build_dir%pch_%pch_name%.obj ^
+    /Ycprocess.hpp /Fp%build_dir%%pch_name%.pch /sourceDependencies %build_dir%pch_%pch_name%.json ^
     %build_dir%pch.cpp /I src\
 )
 
 
 rem Build DLL
 cl /nologo %common_args% ^
-/Yuprocess.hpp /Fp%build_dir%.pch ^
+/Yuprocess.hpp /Fp%build_dir%%pch_name%.pch ^
 /LD  ^
+/Fe%build_dir%%dll_name%.dll /Fo%build_dir%%dll_name%.obj /sourceDependencies %build_dir%%dll_name%.json ^
 /DPROC_PATH=\"%process_abs_path%\" ^
-src\process_wrapper.cpp %build_dir%pch.obj ^
-/link /noimplib /noexp /debug:fastlink /incremental:no ^
+src\process_wrapper.cpp %build_dir%pch_%pch_name%.obj ^
+/link %link_args% ^
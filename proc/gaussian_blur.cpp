@@ -0,0 +1,19 @@
+#include "common.hpp"
+#include "process.hpp"
+#include "filter.hpp"
+
+#define PROC_TRAITS {.halo = gaussian_radius(clamp(param("sigma", 3), 0.1f, 100.f))}
+
+// process() may run on bands of rows, so the image is reported once here
+void init(Image const & image)
+{
+    printf("Processing image %ix%i\n", image.x, image.y);
+}
+
+void process(Image & image)
+{
+    Image src(image.x, image.y, nullptr);
+    image.blit_into(src);
+
+    gaussian_blur(src, image, clamp(param("sigma", 3), 0.1f, 100.f));
+}
\ No newline at end of file
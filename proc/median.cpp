@@ -0,0 +1,19 @@
+#include "common.hpp"
+#include "process.hpp"
+#include "filter.hpp"
+
+#define PROC_TRAITS {.halo = clamp((i32)param("radius", 3), 1, 127)}
+
+// process() may run on bands of rows, so the image is reported once here
+void init(Image const & image)
+{
+    printf("Processing image %ix%i\n", image.x, image.y);
+}
+
+void process(Image & image)
+{
+    Image src(image.x, image.y, nullptr);
+    image.blit_into(src);
+
+    median_filter(src, image, clamp((i32)param("radius", 3), 1, 127));
+}
\ No newline at end of file
@@ -1,16 +1,26 @@
 #include "common.hpp"
 #include "process.hpp"
 
+#define PROC_TRAITS {.pointwise = true}
+
+// process() runs per band of rows, so the image is reported once here
 void init(Image const & image)
 {
-    // printf("Init\n");
+    printf("Processing image %ix%i\n", image.x, image.y);
 }
 
-void process(Image & image)
+// white noise in [0, 1] from the pixel's index in the whole image, the same whichever band or thread it is processed in
+f32 noise(u32 idx)
 {
-    printf("Processing image %ix%i\n", image.x, image.y);
+    idx ^= idx >> 16, idx *= 0x7feb352d;
+    idx ^= idx >> 15, idx *= 0x846ca68b;
+    idx ^= idx >> 16;
+    return f32(idx) / f32(UINT32_MAX);
+}
 
-    srand(123*321);
+void process(Image & image)
+{
+    u32 const first_idx = u32(row_begin() * image.x);
 
     i32 const pixel_count = image.x * image.y;
     #pragma omp parallel for schedule(static)
@@ -25,13 +35,13 @@ void process(Image & image)
             powf(pixel[2] / 255.f, 2.2f) * 0.0722f
         );
 
-        f32 luminance_diff = abs(
+        f32 luminance_diff = fabsf(
             (luminance - pixel[0] / 255.f) +
             (luminance - pixel[1] / 255.f) +
             (luminance - pixel[2] / 255.f)
         );
 
-        luminance *= max(0.f, -0.2f + powf(max(0.f, -0.04f + float(rand()) / RAND_MAX), 0.05f));
+        luminance *= max(0.f, -0.2f + powf(max(0.f, -0.04f + noise(first_idx + u32(i))), 0.05f));
 
         if (luminance < 0.1f) luminance = 0.04f;
         else if (luminance < 0.2f) luminance = 0.13f;
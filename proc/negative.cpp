@@ -1,24 +1,16 @@
 #include "common.hpp"
 #include "process.hpp"
+#include "pixel_expr.hpp"
 
+#define PROC_TRAITS {.pointwise = true}
+
+// process() runs per band of rows, so the image is reported once here
 void init(Image const & image)
 {
-    // printf("Init\n");
+    printf("Processing image %ix%i\n", image.x, image.y);
 }
 
 void process(Image & image)
 {
-    printf("Processing image %ix%i\n", image.x, image.y);
-
-    i32 const pixel_count = image.x * image.y;
-    // #pragma omp parallel for schedule(static)
-    for (i32 i = 0; i < pixel_count; i++)
-    {
-        u8x4 & pixel = image.pixels[i];
-
-        pixel[0] = 255 - pixel[0];
-        pixel[1] = 255 - pixel[1];
-        pixel[2] = 255 - pixel[2];
-        pixel[3] = 255 - pixel[3];
-    }
+    apply(image, 255 - px.r, 255 - px.g, 255 - px.b, 255 - px.a);
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #include "common.hpp"
 #include "process.hpp"
 
+#include "filter.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <emmintrin.h>
 #include <unordered_map>
 
 void init(Image const & image)
@@ -8,6 +13,152 @@ void init(Image const & image)
     // printf("Init\n");
 }
 
+u8x4 & closest_center(u8x4 * centers, int k, int r, int g, int b)
+{
+    u8x4 * closest_center;
+    int min_dist = INT_MAX;
+    for (int ci = 0; ci < k; ++ci)
+    {
+        u8x4 & center = centers[ci];
+        int d0 = r - center[0];
+        int d1 = g - center[1];
+        int d2 = b - center[2];
+        int dist = d0*d0 + d1*d1 + d2*d2;
+
+        if (dist < min_dist)
+            min_dist = dist,
+            closest_center = &center;
+    }
+    return *closest_center;
+}
+
+void remap_nearest(Image & image, u8x4 * centers, int k)
+{
+    i32 const pixel_count = image.x * image.y;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < pixel_count; i++)
+    {
+        u8x4 & pixel = image.pixels[i];
+        memcpy(pixel, closest_center(centers, k, pixel[0], pixel[1], pixel[2]), 4);
+    }
+}
+
+// 8x8 Bayer matrix, every pixel is offset by its threshold before snapping, rows are independent
+void remap_ordered(Image & image, u8x4 * centers, int k, f32 spread)
+{
+    static constexpr u8 bayer[8][8] = {
+        { 0, 32,  8, 40,  2, 34, 10, 42},
+        {48, 16, 56, 24, 50, 18, 58, 26},
+        {12, 44,  4, 36, 14, 46,  6, 38},
+        {60, 28, 52, 20, 62, 30, 54, 22},
+        { 3, 35, 11, 43,  1, 33,  9, 41},
+        {51, 19, 59, 27, 49, 17, 57, 25},
+        {15, 47,  7, 39, 13, 45,  5, 37},
+        {63, 31, 55, 23, 61, 29, 53, 21},
+    };
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < image.y; ++y)
+        for (int x = 0; x < image.x; ++x)
+        {
+            u8x4 & pixel = image.pixels[y * image.x + x];
+            int offset = int(spread * ((bayer[y % 8][x % 8] + 0.5f) / 64.f - 0.5f));
+            memcpy(pixel, closest_center(
+                centers, k,
+                clamp(pixel[0] + offset, 0, 255),
+                clamp(pixel[1] + offset, 0, 255),
+                clamp(pixel[2] + offset, 0, 255)
+            ), 4);
+        }
+}
+
+/* Floyd-Steinberg on a wavefront
+ A pixel only needs its left neighbour (carried in a register) and the row above up to x + 1,
+ so every row can run on its own thread as long as it stays 2 pixels behind the row above.
+ Rows publish their progress every progress_step pixels. Errors pushed down go into a small ring of rows,
+ a row zeroes its errors as it consumes them so the ring slot is clean when it comes around again.
+*/
+void remap_error_diffusion(Image & image, u8x4 * centers, int k)
+{
+    i32 const progress_step = 32;
+    i32 const ring_size = 4; // the wavefront guarantees readers are ahead of writers sharing a slot
+    i32 const row_size = (image.x + 2) * 3; // 1 pixel padding on both sides, errors are x16
+
+    unique_array<i32> errors{new i32[ring_size * row_size]()};
+    unique_array<std::atomic<i32>> progress{new std::atomic<i32>[image.y]};
+    for (int y = 0; y < image.y; ++y)
+        progress[y].store(0, std::memory_order_relaxed);
+
+    #pragma omp parallel for schedule(static, 1)
+    for (int y = 0; y < image.y; ++y)
+    {
+        i32 * here = errors.things + (y % ring_size) * row_size + 3;
+        i32 * below = errors.things + ((y + 1) % ring_size) * row_size + 3;
+        i32 above_progress = y == 0 ? image.x : 0;
+        i32 carry[3] = {0, 0, 0};
+
+        for (int x = 0; x < image.x; ++x)
+        {
+            i32 const needed = min(x + 2, image.x);
+            while (above_progress < needed)
+            {
+                above_progress = progress[y - 1].load(std::memory_order_acquire);
+                if (above_progress < needed) _mm_pause();
+            }
+
+            u8x4 & pixel = image.pixels[y * image.x + x];
+            int value[3];
+            for (int c = 0; c < 3; ++c)
+            {
+                value[c] = clamp(pixel[c] + ((here[x * 3 + c] + carry[c] + 8) >> 4), 0, 255);
+                here[x * 3 + c] = 0;
+            }
+
+            u8x4 & center = closest_center(centers, k, value[0], value[1], value[2]);
+
+            for (int c = 0; c < 3; ++c)
+            {
+                int const error = value[c] - center[c];
+                carry[c] = error * 7;
+                below[(x - 1) * 3 + c] += error * 3;
+                below[x * 3 + c] += error * 5;
+                below[(x + 1) * 3 + c] += error * 1;
+            }
+
+            memcpy(pixel, center, 4);
+
+            if ((x + 1) % progress_step == 0)
+                progress[y].store(x + 1, std::memory_order_release);
+        }
+        progress[y].store(image.x, std::memory_order_release);
+    }
+}
+
+f64 psnr(Image const & a, Image const & b)
+{
+    i32 const pixel_count = a.x * a.y;
+    f64 squared_error = 0;
+    #pragma omp parallel for schedule(static) reduction(+: squared_error)
+    for (int i = 0; i < pixel_count; i++)
+        for (int c = 0; c < 3; ++c)
+        {
+            f64 d = f64(a.pixels[i][c]) - b.pixels[i][c];
+            squared_error += d * d;
+        }
+
+    f64 const mse = squared_error / (pixel_count * 3.);
+    return mse == 0 ? INFINITY : 10 * log10(255. * 255. / mse);
+}
+
+// dithering trades PSNR for less banding, comparing blurred images is closer to what the eye sees
+f64 blurred_psnr(Image const & a, Image const & b)
+{
+    Image blurred_a(a.x, a.y, nullptr), blurred_b(b.x, b.y, nullptr);
+    box_blur(a, blurred_a, 2);
+    box_blur(b, blurred_b, 2);
+    return psnr(blurred_a, blurred_b);
+}
+
 void process(Image & image)
 {
     printf("Processing image %ix%i\n", image.x, image.y);
@@ -51,15 +202,16 @@ void process(Image & image)
 
     srand(123*321);
 
-    int const k = 28;
-    u8x4 centers[k];
-    for (u8x4 & center : centers)
-        memcpy(center, colors[rand() % colors_size], 4);
+    int const max_k = 256;
+    int const k = clamp((int)param("k", 28), 1, max_k);
+    u8x4 centers[max_k];
+    for (int ci = 0; ci < k; ++ci)
+        memcpy(centers[ci], colors[rand() % colors_size], 4);
 
     for (int iteration = 0; iteration < 64; ++iteration)
     {
         // find the means
-        u32x4 means[k] = {0};
+        u32x4 means[max_k] = {0};
         for (int i = 0; i < colors_size; ++i)
         {
             u8x4 & color = colors[i];
@@ -126,26 +278,44 @@ void process(Image & image)
         }
     }
 
-    #pragma omp parallel for schedule(static)
-    for (int i = 0; i < pixel_count; i++)
+    // 0: nearest center, 1: error diffusion, 2: ordered
+    int const dither = (int)param("dither", 0);
+    if (dither == 0)
     {
-        u8x4 & pixel = pixels[i];
-
-        u8x4 * closest_center;
-        int min_dist = INT_MAX;
-        for (u8x4 & center : centers)
-        {
-            int d0 = int(pixel[0]) - center[0];
-            int d1 = int(pixel[1]) - center[1];
-            int d2 = int(pixel[2]) - center[2];
-            int dist = d0*d0 + d1*d1 + d2*d2;
-
-            if (dist < min_dist)
-                min_dist = dist,
-                closest_center = &center;
-        }
-
-        memcpy(pixel, closest_center, 4);
+        remap_nearest(image, centers, k);
+    }
+    else if (param("compare", 0) == 0)
+    {
+        if (dither == 1) remap_error_diffusion(image, centers, k);
+        else             remap_ordered(image, centers, k, param("spread", 32));
+    }
+    else // compare=1 also remaps to the nearest center and reports both, for tuning the dither only
+    {
+        using clock = std::chrono::steady_clock;
+        auto ms_since = [](clock::time_point begin) { return std::chrono::duration<f64, std::milli>(clock::now() - begin).count(); };
+
+        Image source(image.x, image.y, nullptr);
+        image.blit_into(source);
+
+        Image nearest(image.x, image.y, nullptr);
+        image.blit_into(nearest);
+        auto const nearest_begin = clock::now();
+        remap_nearest(nearest, centers, k);
+        f64 const nearest_ms = ms_since(nearest_begin);
+
+        auto const dither_begin = clock::now();
+        if (dither == 1) remap_error_diffusion(image, centers, k);
+        else             remap_ordered(image, centers, k, param("spread", 32));
+        f64 const dither_ms = ms_since(dither_begin);
+
+        printf(
+            "Remap | %-15s | %8.2f ms | PSNR %6.2f dB | blurred PSNR %6.2f dB\n",
+            "nearest", nearest_ms, psnr(source, nearest), blurred_psnr(source, nearest)
+        );
+        printf(
+            "Remap | %-15s | %8.2f ms | PSNR %6.2f dB | blurred PSNR %6.2f dB\n",
+            dither == 1 ? "error diffusion" : "ordered", dither_ms, psnr(source, image), blurred_psnr(source, image)
+        );
     }
 
 
@@ -157,15 +327,11 @@ void process(Image & image)
         u8x4 & center = centers[i];
         int const dim = 16;
         int const grid_dim = 32;
-        u8x4 * iter = pixels.begin();
-        iter += dim * (i % grid_dim); // x
-        iter += dim * (i / grid_dim) * image.y; // y
-        for (int y = 0; y < dim; ++y)
-        {
-            for (int x = 0; x < dim; ++x)
-                memcpy(iter + x, center, 4);
-
-            iter += image.x;
-        }
+        int const x_begin = dim * (i % grid_dim);
+        int const y_begin = dim * (i / grid_dim);
+        // swatches past the image's edges are cut, k can be up to 256 (8 rows of them)
+        for (int y = y_begin; y < min(y_begin + dim, image.y); ++y)
+            for (int x = x_begin; x < min(x_begin + dim, image.x); ++x)
+                memcpy(pixels[y * image.x + x], center, 4);
     }
 }
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include "common.hpp"
+#include "process.hpp"
+#include "pixel_expr.hpp"
+
+#define PROC_TRAITS {.pointwise = true}
+
+u8 gamma_lut[256];
+
+void init(Image const & image)
+{
+    printf("Processing image %ix%i\n", image.x, image.y);
+
+    f32 const gamma = param("gamma", 1.2f);
+    for (int i = 0; i < 256; ++i)
+        gamma_lut[i] = u8(255 * powf(i / 255.f, 1 / gamma) + 0.5f);
+}
+
+void process(Image & image)
+{
+    auto const r = lut(gamma_lut, px.r);
+    auto const g = lut(gamma_lut, px.g);
+    auto const b = lut(gamma_lut, px.b);
+
+    auto const sepia_r = r * 0.393f + g * 0.769f + b * 0.189f;
+    auto const sepia_g = r * 0.349f + g * 0.686f + b * 0.168f;
+    auto const sepia_b = r * 0.272f + g * 0.534f + b * 0.131f;
+
+    // keep the shadows neutral
+    auto const luma = r * 0.2126f + g * 0.7152f + b * 0.0722f;
+    auto const shadow = luma < param("shadow", 24);
+
+    apply(image,
+        select(shadow, luma, sepia_r),
+        select(shadow, luma, sepia_g),
+        select(shadow, luma, sepia_b),
+        px.a
+    );
+}
\ No newline at end of file
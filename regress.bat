@@ -0,0 +1 @@
+build\main.exe --regress regress\manifest.txt %*
\ No newline at end of file
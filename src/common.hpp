@@ -5,23 +5,33 @@
 #include <ciso646>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <string_view>
+#include <type_traits>
 
+using i8 = int8_t;
 using i32 = int32_t;
 using i64 = int64_t;
 using u8 = uint8_t;
 using u8x4 = u8[4];
+using u16 = uint16_t;
 using u32 = uint32_t;
 using u32x3 = u32[3];
 using u32x4 = u32[4];
 using u64 = uint64_t;
 using f32 = float;
 using f64 = double;
-
-template<typename T> T max(T a, T b) { return a > b ? a : b; }
-template<typename T> T min(T a, T b) { return a < b ? a : b; }
-template<typename T> T clamp(T a, T l, T h) { return max(l, min(a, h)); }
-template<typename T> T saturate(T a) { return max(T{0}, min(a, T{1})); }
+using str = std::string;
+using strview = std::string_view;
+using wstr = std::wstring;
+using wstrview = std::wstring_view;
+
+template<typename T> concept arithmetic = std::is_arithmetic_v<T>;
+template<arithmetic T> T max(T a, T b) { return a > b ? a : b; }
+template<arithmetic T> T min(T a, T b) { return a < b ? a : b; }
+template<arithmetic T> T clamp(T a, T l, T h) { return max(l, min(a, h)); }
+template<arithmetic T> T saturate(T a) { return max(T{0}, min(a, T{1})); }
 template<typename C, typename T> C && reinterpret_move(T & t) { return reinterpret_cast<C &&>(t);}
 
 template<typename T>
@@ -43,14 +53,20 @@ struct unique_one
 template<typename T>
 struct unique_array
 {
+	using deleter = void(T * things);
+
 	T * things;
-	unique_array() : things(nullptr) {}
-	unique_array(T * && raw) : things(raw) { raw = nullptr; }
+	deleter * release; // nullptr means delete[]
+	unique_array() : things(nullptr), release(nullptr) {}
+	unique_array(T * && raw) : things(raw), release(nullptr) { raw = nullptr; }
+	unique_array(T * && raw, deleter * release) : things(raw), release(release) { raw = nullptr; }
     unique_array(unique_array const &) = delete;
     unique_array& operator=(unique_array const &) = delete;
-    unique_array(unique_array && o) : things(o.things) { o.things = nullptr; }
-    unique_array& operator=(unique_array && o) { delete[] things; things = o.things; o.things = nullptr; return *this;}
-	~unique_array() { delete[] things; }
+    unique_array(unique_array && o) : things(o.things), release(o.release) { o.things = nullptr; }
+    unique_array& operator=(unique_array && o) { reset(); things = o.things; release = o.release; o.things = nullptr; return *this;}
+	~unique_array() { reset(); }
+
+	void reset() { if (not things) return; if (release) release(things); else delete[] things; things = nullptr; }
 
 	operator bool() const { return things != nullptr; }
 	T & operator [](int idx) const { return things[idx]; }
@@ -91,6 +107,15 @@ void print_err(const char *fmt, ...) {
     va_end(args);
 }
 
+// FNV-1a, see http://www.isthe.com/chongo/tech/comp/fnv/
+u64 fnv1a(void const * data, size_t size, u64 hash = 0xcbf29ce484222325)
+{
+    auto bytes = (u8 const *)data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    return hash;
+}
+
 
 ///--- Graphics
 struct Image
@@ -102,6 +127,11 @@ struct Image
     Image() = default;
     Image(int x, int y, nullptr_t) : pixels(new u8x4[x * y]), x(x), y(y) {}
     Image(int x, int y, u8x4 * && pixels) : pixels(std::move(pixels)), x(x), y(y) {}
+    Image(int x, int y, u8x4 * && pixels, unique_array<u8x4>::deleter * release) : pixels(std::move(pixels), release), x(x), y(y) {}
+
+    // a non-owning Image over the rows [begin, end)
+    Image rows(i32 begin, i32 end) const
+    { return {x, end - begin, pixels.things + begin * x, [](u8x4 *){}}; }
 
     void blit_into(Image & o) const
     { memcpy(o.pixels, pixels, o.x * o.y * sizeof(u8x4)); }
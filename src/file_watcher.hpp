@@ -0,0 +1,277 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <chrono>
+#include <vector>
+
+#if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+    #define NOMINMAX
+    #endif
+    #include <windows.h>
+    #include <cwctype>
+#elif defined(__linux__)
+    #include <sys/inotify.h>
+    #include <unistd.h>
+    #include <cerrno>
+#endif
+
+/* File watcher
+ Watches a set of files, is_notified() is true once after a burst of changes settles.
+ Editors often save with several writes (or write a temp file and rename it over), so changes are
+ coalesced until nothing happened for debounce_ms, then reported once.
+
+ Directories are watched instead of the files, a rename over a file replaces it and would end a
+ watch on the file itself. Backends: ReadDirectoryChangesW on Windows, inotify on Linux.
+*/
+
+#if defined(_WIN32)
+inline wstr str_to_wstr(str const & str)
+{
+    wstr wstr;
+    wstr.resize(MultiByteToWideChar(CP_UTF8, 0, str.c_str(), (int)str.size(), nullptr, 0));
+    MultiByteToWideChar(CP_UTF8, 0, str.data(), (int)str.size(), wstr.data(), (int)wstr.size());
+    return wstr;
+}
+#endif
+
+class FileWatcher
+{
+    static constexpr i64 debounce_ms = 150;
+
+    using clock = std::chrono::steady_clock;
+    bool is_pending = false;
+    clock::time_point last_change;
+
+#if defined(_WIN32)
+    static constexpr size_t buffer_size = 4 << 10;
+    static constexpr DWORD notify_filter = FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME;
+
+    // file names are lower case, paths on windows are case insensitive
+    struct Directory
+    {
+        wstr path;
+        std::vector<wstr> file_names;
+        unique_array<std::byte> buffer{new std::byte[buffer_size]};
+        HANDLE handle = INVALID_HANDLE_VALUE;
+        OVERLAPPED overlapped{.hEvent = nullptr};
+    };
+
+    static wstr to_lower(wstr s)
+    {
+        for (wchar_t & c : s) c = (wchar_t)towlower(c);
+        return s;
+    }
+
+    static void read_changes(Directory & dir)
+    {
+        if (not ReadDirectoryChangesW(
+            dir.handle,
+            dir.buffer, buffer_size,
+            false,
+            notify_filter,
+            nullptr,
+            &dir.overlapped,
+            nullptr
+        )) exit_err("[Error] ReadDirectoryChangesW failed");
+    }
+#elif defined(__linux__)
+    struct Directory
+    {
+        str path;
+        std::vector<str> file_names;
+        int watch = -1;
+    };
+
+    int inotify = -1;
+#endif
+
+    std::vector<Directory> directories;
+
+    void close()
+    {
+#if defined(_WIN32)
+        for (Directory & dir : directories)
+        {
+            if (dir.handle != INVALID_HANDLE_VALUE)
+            {
+                // the kernel writes into overlapped and buffer until the cancelled read completes
+                DWORD bytes_written;
+                if (CancelIo(dir.handle) and dir.overlapped.hEvent)
+                    GetOverlappedResult(dir.handle, &dir.overlapped, &bytes_written, true);
+                CloseHandle(dir.handle);
+            }
+            if (dir.overlapped.hEvent) CloseHandle(dir.overlapped.hEvent);
+        }
+#elif defined(__linux__)
+        for (Directory & dir : directories)
+            if (dir.watch != -1) inotify_rm_watch(inotify, dir.watch);
+#endif
+        directories.clear();
+    }
+
+    void on_change()
+    {
+        is_pending = true;
+        last_change = clock::now();
+    }
+
+public:
+    FileWatcher() = default;
+    FileWatcher(FileWatcher const &) = delete;
+
+    ~FileWatcher()
+    {
+        close();
+#if defined(__linux__)
+        if (inotify != -1) ::close(inotify);
+#endif
+    }
+
+    // replaces the watched files, paths must be absolute
+    void watch(std::vector<str> const & file_abs_paths)
+    {
+        close();
+
+        for (str const & file_abs_path : file_abs_paths)
+        {
+#if defined(_WIN32)
+            wstr const path = str_to_wstr(file_abs_path);
+            size_t const dir_end_idx = path.find_last_of(L"\\/");
+            if (dir_end_idx == wstr::npos) exit_err("[Error] Invalid path");
+            wstr const dir_path = to_lower(path.substr(0, dir_end_idx));
+            wstr const file_name = to_lower(path.substr(dir_end_idx + 1));
+#elif defined(__linux__)
+            size_t const dir_end_idx = file_abs_path.find_last_of('/');
+            if (dir_end_idx == str::npos) exit_err("[Error] Invalid path");
+            str const dir_path = dir_end_idx == 0 ? "/" : file_abs_path.substr(0, dir_end_idx);
+            str const file_name = file_abs_path.substr(dir_end_idx + 1);
+#endif
+
+            Directory * dir = nullptr;
+            for (Directory & d : directories)
+                if (d.path == dir_path) dir = &d;
+            if (not dir)
+            {
+                directories.emplace_back();
+                dir = &directories.back();
+                dir->path = dir_path;
+            }
+            dir->file_names.push_back(file_name);
+        }
+
+        // a directory that can't be watched (e.g. a stale dependency in a deleted one) is left out, the rest are still watched
+#if defined(_WIN32)
+        for (auto dir = directories.begin(); dir != directories.end();)
+        {
+            dir->handle = CreateFileW(
+                dir->path.c_str(),
+                FILE_LIST_DIRECTORY,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                0,
+                OPEN_EXISTING,
+                FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                0
+            );
+            if (dir->handle == INVALID_HANDLE_VALUE)
+            {
+                print_err("[Warning] Can't watch \"%ls\" (error %lu), changes in it are not noticed.\n", dir->path.c_str(), GetLastError());
+                dir = directories.erase(dir);
+                continue;
+            }
+
+            dir->overlapped.hEvent = CreateEventA(0, false, false, nullptr);
+            if (dir->overlapped.hEvent == nullptr) exit_err("[Error] CreateEventA failed");
+
+            read_changes(*dir);
+            ++dir;
+        }
+#elif defined(__linux__)
+        if (inotify == -1) inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify == -1) exit_err("[Error] inotify_init1 failed");
+
+        for (auto dir = directories.begin(); dir != directories.end();)
+        {
+            dir->watch = inotify_add_watch(inotify, dir->path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (dir->watch == -1)
+            {
+                print_err("[Warning] Can't watch \"%s\" (%s), changes in it are not noticed.\n", dir->path.c_str(), strerror(errno));
+                dir = directories.erase(dir);
+            }
+            else ++dir;
+        }
+#endif
+    }
+
+    bool is_notified()
+    {
+#if defined(_WIN32)
+        for (Directory & dir : directories)
+        {
+            // there may be many notifications, process all
+            while (true)
+            {
+                DWORD bytes_written;
+                if (not GetOverlappedResult(dir.handle, &dir.overlapped, &bytes_written, false))
+                {
+                    if (GetLastError() != ERROR_IO_INCOMPLETE) exit_err("[Error] GetOverlappedResult failed\n");
+                    break;
+                }
+
+                std::byte * ptr = dir.buffer.things;
+                FILE_NOTIFY_INFORMATION * notification = reinterpret_cast<FILE_NOTIFY_INFORMATION *>(ptr);
+                // 0 bytes means the buffer overflowed, something changed but we can't tell what
+                if (bytes_written == 0) on_change();
+                else while (true)
+                {
+                    wstr const name = to_lower({notification->FileName, notification->FileNameLength / sizeof(wchar_t)});
+                    for (wstr const & file_name : dir.file_names)
+                        if (name == file_name) on_change();
+
+                    // check for any other notifications
+                    if (notification->NextEntryOffset == 0) break;
+
+                    ptr += notification->NextEntryOffset;
+                    notification = reinterpret_cast<FILE_NOTIFY_INFORMATION *>(ptr);
+                }
+
+                read_changes(dir);
+            }
+        }
+#elif defined(__linux__)
+        alignas(inotify_event) char buffer[4 << 10];
+        while (inotify != -1)
+        {
+            ssize_t const size = read(inotify, buffer, sizeof(buffer));
+            if (size <= 0)
+            {
+                if (size < 0 and errno != EAGAIN) exit_err("[Error] inotify read failed");
+                break;
+            }
+
+            for (char * ptr = buffer; ptr < buffer + size;)
+            {
+                inotify_event const * event = reinterpret_cast<inotify_event *>(ptr);
+                if (event->mask & IN_Q_OVERFLOW) on_change();
+
+                for (Directory const & dir : directories)
+                    if (dir.watch == event->wd and event->len > 0)
+                        for (str const & file_name : dir.file_names)
+                            if (file_name == event->name) on_change();
+
+                ptr += sizeof(inotify_event) + event->len;
+            }
+        }
+#endif
+
+        if (not is_pending) return false;
+        if (clock::now() - last_change < std::chrono::milliseconds(debounce_ms)) return false;
+
+        is_pending = false;
+        return true;
+    }
+};
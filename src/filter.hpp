@@ -0,0 +1,338 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+
+/* Neighborhood filters
+ All filters read from src and write into dst, they must not alias.
+ Borders are clamp-to-edge.
+
+ The image is split into tile_dim x tile_dim tiles, each tile gathers its halo into a thread local
+ buffer so the vertical pass walks a small cache resident block instead of striding through the
+ whole image. Tiles are distributed over threads, one pixel (4 channels) is one SSE register.
+*/
+
+constexpr i32 filter_tile_dim = 64;
+
+inline __m128i load_pixel_i32(u8x4 const & pixel)
+{
+    __m128i const zero = _mm_setzero_si128();
+    __m128i v = _mm_cvtsi32_si128(*(i32 const *)pixel);
+    v = _mm_unpacklo_epi8(v, zero);
+    return _mm_unpacklo_epi16(v, zero);
+}
+
+inline __m128 load_pixel_f32(u8x4 const & pixel)
+{ return _mm_cvtepi32_ps(load_pixel_i32(pixel)); }
+
+inline void store_pixel_f32(u8x4 & pixel, __m128 v)
+{
+    __m128i i = _mm_cvtps_epi32(v); // rounds to nearest
+    i = _mm_packs_epi32(i, i);
+    i = _mm_packus_epi16(i, i); // saturates to [0, 255]
+    *(i32 *)pixel = _mm_cvtsi128_si32(i);
+}
+
+struct FilterTile
+{
+    i32 x0, y0, x1, y1;
+
+    i32 width() const { return x1 - x0; }
+    i32 height() const { return y1 - y0; }
+};
+
+struct FilterTiling
+{
+    i32 count_x, count_y;
+
+    FilterTiling(Image const & image) :
+        count_x((image.x + filter_tile_dim - 1) / filter_tile_dim),
+        count_y((image.y + filter_tile_dim - 1) / filter_tile_dim)
+    {}
+
+    i32 count() const { return count_x * count_y; }
+
+    FilterTile operator[](i32 idx) const
+    {
+        FilterTile tile;
+        tile.x0 = (idx % count_x) * filter_tile_dim;
+        tile.y0 = (idx / count_x) * filter_tile_dim;
+        tile.x1 = tile.x0 + filter_tile_dim;
+        tile.y1 = tile.y0 + filter_tile_dim;
+        return tile;
+    }
+};
+
+// tile.x1/y1 may be past the image, this clips them
+inline FilterTile clip_tile(FilterTile tile, Image const & image)
+{
+    tile.x1 = min(tile.x1, image.x);
+    tile.y1 = min(tile.y1, image.y);
+    return tile;
+}
+
+// indices of [begin - halo, end + halo) clamped into [0, size)
+inline void clamped_indices(i32 begin, i32 end, i32 halo, i32 size, i32 * out)
+{
+    for (i32 i = begin - halo; i < end + halo; ++i)
+        *out++ = clamp(i, 0, size - 1);
+}
+
+
+///--- Separable convolution
+
+// fills a normalized kernel, radius is kernel.size / 2, sigma must be > 0
+inline void gaussian_kernel(f32 sigma, span<f32> kernel)
+{
+    i32 const radius = kernel.size / 2;
+    f32 sum = 0;
+    for (i32 i = 0; i < kernel.size; ++i)
+    {
+        f32 d = f32(i - radius);
+        kernel[i] = expf(-(d * d) / (2 * sigma * sigma));
+        sum += kernel[i];
+    }
+    for (f32 & weight : kernel)
+        weight /= sum;
+}
+
+// kernel sizes must be odd
+void convolve_separable(Image const & src, Image & dst, span<f32> kernel_x, span<f32> kernel_y)
+{
+    i32 const rx = kernel_x.size / 2;
+    i32 const ry = kernel_y.size / 2;
+    i32 const line_size = filter_tile_dim + 2 * rx;
+    i32 const rows_size = filter_tile_dim + 2 * ry;
+
+    FilterTiling const tiling(src);
+
+    #pragma omp parallel
+    {
+        unique_array<i32> cols{new i32[line_size]};
+        unique_array<i32> rows{new i32[rows_size]};
+        unique_array<__m128> line{new __m128[line_size]};
+        unique_array<__m128> horizontal{new __m128[rows_size * filter_tile_dim]};
+
+        #pragma omp for schedule(dynamic)
+        for (i32 t = 0; t < tiling.count(); ++t)
+        {
+            FilterTile const tile = clip_tile(tiling[t], src);
+            i32 const w = tile.width();
+            i32 const h = tile.height();
+            clamped_indices(tile.x0, tile.x1, rx, src.x, cols);
+            clamped_indices(tile.y0, tile.y1, ry, src.y, rows);
+
+            // horizontal pass, tile rows + halo rows into the tile buffer
+            for (i32 y = 0; y < h + 2 * ry; ++y)
+            {
+                u8x4 const * src_row = src.pixels.things + rows[y] * src.x;
+                for (i32 x = 0; x < w + 2 * rx; ++x)
+                    line[x] = load_pixel_f32(src_row[cols[x]]);
+
+                __m128 * out = horizontal.things + y * filter_tile_dim;
+                for (i32 x = 0; x < w; ++x)
+                {
+                    __m128 sum = _mm_setzero_ps();
+                    for (i32 k = 0; k < kernel_x.size; ++k)
+                        sum = _mm_add_ps(sum, _mm_mul_ps(line[x + k], _mm_set1_ps(kernel_x[k])));
+                    out[x] = sum;
+                }
+            }
+
+            // vertical pass, reads only the cache resident tile buffer
+            for (i32 y = 0; y < h; ++y)
+            {
+                u8x4 * dst_row = dst.pixels.things + (tile.y0 + y) * dst.x + tile.x0;
+                for (i32 x = 0; x < w; ++x)
+                {
+                    __m128 const * in = horizontal.things + y * filter_tile_dim + x;
+                    __m128 sum = _mm_setzero_ps();
+                    for (i32 k = 0; k < kernel_y.size; ++k)
+                        sum = _mm_add_ps(sum, _mm_mul_ps(in[k * filter_tile_dim], _mm_set1_ps(kernel_y[k])));
+                    store_pixel_f32(dst_row[x], sum);
+                }
+            }
+        }
+    }
+}
+
+inline i32 gaussian_radius(f32 sigma)
+{ return max(1, i32(ceilf(3 * sigma))); }
+
+void gaussian_blur(Image const & src, Image & dst, f32 sigma)
+{
+    i32 const radius = gaussian_radius(sigma);
+    unique_array<f32> weights{new f32[2 * radius + 1]};
+    span<f32> kernel{weights, 2 * radius + 1};
+    gaussian_kernel(sigma, kernel);
+
+    convolve_separable(src, dst, kernel, kernel);
+}
+
+
+///--- Box blur
+// Sliding window sums, O(1) per pixel regardless of the radius.
+
+// radius must be <= 1450, the sums of (2 * radius + 1)^2 pixels have to fit into i32
+void box_blur(Image const & src, Image & dst, i32 radius)
+{
+    i32 const window = 2 * radius + 1;
+    i32 const line_size = filter_tile_dim + 2 * radius;
+    __m128 const inv_area = _mm_set1_ps(1.f / f32(window * window));
+
+    FilterTiling const tiling(src);
+
+    #pragma omp parallel
+    {
+        unique_array<i32> cols{new i32[line_size]};
+        unique_array<i32> rows{new i32[line_size]};
+        unique_array<__m128i> horizontal{new __m128i[line_size * filter_tile_dim]};
+        unique_array<__m128i> column_sums{new __m128i[filter_tile_dim]};
+
+        #pragma omp for schedule(dynamic)
+        for (i32 t = 0; t < tiling.count(); ++t)
+        {
+            FilterTile const tile = clip_tile(tiling[t], src);
+            i32 const w = tile.width();
+            i32 const h = tile.height();
+            clamped_indices(tile.x0, tile.x1, radius, src.x, cols);
+            clamped_indices(tile.y0, tile.y1, radius, src.y, rows);
+
+            // horizontal running sums
+            for (i32 y = 0; y < h + 2 * radius; ++y)
+            {
+                u8x4 const * src_row = src.pixels.things + rows[y] * src.x;
+                __m128i * out = horizontal.things + y * filter_tile_dim;
+
+                __m128i sum = _mm_setzero_si128();
+                for (i32 k = 0; k < window; ++k)
+                    sum = _mm_add_epi32(sum, load_pixel_i32(src_row[cols[k]]));
+                out[0] = sum;
+
+                for (i32 x = 1; x < w; ++x)
+                {
+                    sum = _mm_add_epi32(sum, load_pixel_i32(src_row[cols[x + 2 * radius]]));
+                    sum = _mm_sub_epi32(sum, load_pixel_i32(src_row[cols[x - 1]]));
+                    out[x] = sum;
+                }
+            }
+
+            // vertical running sums, one accumulator per column, walks the buffer row by row
+            for (i32 x = 0; x < w; ++x)
+                column_sums[x] = _mm_setzero_si128();
+            for (i32 k = 0; k < window; ++k)
+                for (i32 x = 0; x < w; ++x)
+                    column_sums[x] = _mm_add_epi32(column_sums[x], horizontal[k * filter_tile_dim + x]);
+
+            for (i32 y = 0; y < h; ++y)
+            {
+                u8x4 * dst_row = dst.pixels.things + (tile.y0 + y) * dst.x + tile.x0;
+                for (i32 x = 0; x < w; ++x)
+                    store_pixel_f32(dst_row[x], _mm_mul_ps(_mm_cvtepi32_ps(column_sums[x]), inv_area));
+
+                if (y + 1 == h) break;
+
+                __m128i const * entering = horizontal.things + (y + window) * filter_tile_dim;
+                __m128i const * leaving = horizontal.things + y * filter_tile_dim;
+                for (i32 x = 0; x < w; ++x)
+                    column_sums[x] = _mm_sub_epi32(_mm_add_epi32(column_sums[x], entering[x]), leaving[x]);
+            }
+        }
+    }
+}
+
+
+///--- Median
+// Huang's sliding histogram, each channel keeps a fine (256 bins) and a coarse (16 bins) histogram
+// so finding the median is at most 16 + 16 steps.
+
+struct MedianHistogram
+{
+    u16 coarse[4][16];
+    u16 fine[4][256];
+
+    void clear() { memset(this, 0, sizeof(*this)); }
+
+    void add(u8x4 const & pixel)
+    {
+        for (i32 c = 0; c < 4; ++c)
+            coarse[c][pixel[c] >> 4] += 1, fine[c][pixel[c]] += 1;
+    }
+
+    void remove(u8x4 const & pixel)
+    {
+        for (i32 c = 0; c < 4; ++c)
+            coarse[c][pixel[c] >> 4] -= 1, fine[c][pixel[c]] -= 1;
+    }
+
+    u8 median(i32 channel, i32 half_count) const
+    {
+        i32 acc = 0;
+        i32 bucket = 0;
+        while (acc + coarse[channel][bucket] <= half_count)
+            acc += coarse[channel][bucket++];
+
+        i32 bin = bucket << 4;
+        while (acc + fine[channel][bin] <= half_count)
+            acc += fine[channel][bin++];
+
+        return u8(bin);
+    }
+};
+
+// radius must be < 128, (2 * radius + 1)^2 has to fit into the u16 bins
+void median_filter(Image const & src, Image & dst, i32 radius)
+{
+    i32 const window = 2 * radius + 1;
+    i32 const half_count = window * window / 2;
+    i32 const line_size = filter_tile_dim + 2 * radius;
+
+    FilterTiling const tiling(src);
+
+    #pragma omp parallel
+    {
+        unique_array<i32> cols{new i32[line_size]};
+        unique_array<i32> rows{new i32[line_size]};
+        unique_one<MedianHistogram> histogram_owner{new MedianHistogram};
+        MedianHistogram & histogram = *histogram_owner.thing;
+
+        #pragma omp for schedule(dynamic)
+        for (i32 t = 0; t < tiling.count(); ++t)
+        {
+            FilterTile const tile = clip_tile(tiling[t], src);
+            i32 const w = tile.width();
+            i32 const h = tile.height();
+            clamped_indices(tile.x0, tile.x1, radius, src.x, cols);
+            clamped_indices(tile.y0, tile.y1, radius, src.y, rows);
+
+            for (i32 y = 0; y < h; ++y)
+            {
+                u8x4 const * window_rows[256];
+                for (i32 k = 0; k < window; ++k)
+                    window_rows[k] = src.pixels.things + rows[y + k] * src.x;
+
+                histogram.clear();
+                for (i32 k = 0; k < window; ++k)
+                    for (i32 j = 0; j < window; ++j)
+                        histogram.add(window_rows[k][cols[j]]);
+
+                u8x4 * dst_row = dst.pixels.things + (tile.y0 + y) * dst.x + tile.x0;
+                for (i32 x = 0; x < w; ++x)
+                {
+                    if (x > 0)
+                        for (i32 k = 0; k < window; ++k)
+                        {
+                            histogram.remove(window_rows[k][cols[x - 1]]);
+                            histogram.add(window_rows[k][cols[x + 2 * radius]]);
+                        }
+
+                    for (i32 c = 0; c < 4; ++c)
+                        dst_row[x][c] = histogram.median(c, half_count);
+                }
+            }
+        }
+    }
+}
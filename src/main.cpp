@@ -16,6 +16,15 @@
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <windows.h>
+#include <psapi.h>
+
+#include <intrin.h>
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cmath>
 
 bool exec(const char * cmd, str & out, i32 & exit_code) {
 	// https://learn.microsoft.com/en-us/cpp/c-runtime-library/reference/popen-wpopen?view=msvc-170#example
@@ -40,12 +49,14 @@ bool exec(const char * cmd, str & out, i32 & exit_code) {
     return true;
 }
 
+bool is_quiet = false; // skips the per run logs, for batch modes
+
 struct Timer
 {
 	i64 begin;
 	const char * tag;
 	Timer(const char * tag) : begin(GetTickCount64()), tag(tag) {}
-	~Timer() { printf("[Timer] %6lld ms | %s\n", GetTickCount64() - begin, tag); }
+	~Timer() { if (not is_quiet) printf("[Timer] %6lld ms | %s\n", GetTickCount64() - begin, tag); }
 };
 #define TimeScope(tag) Timer timer(tag)
 
@@ -61,17 +72,179 @@ u64 get_file_last_write(const char * path)
 	return ULARGE_INTEGER{attrb.ftLastWriteTime.dwLowDateTime, attrb.ftLastWriteTime.dwHighDateTime}.QuadPart;
 }
 
-const char * const dll_rel_path = "build_dll\\process_wrapper.dll";
+// size and last write time, both 0 if the file can't be queried
+struct FileStamp
+{
+	u64 size = 0, last_write = 0;
+
+	bool operator==(FileStamp const &) const = default;
+};
+
+FileStamp get_file_stamp(const char * path)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attrb;
+	if (not GetFileAttributesExA(path, GetFileExInfoStandard, &attrb)) return {};
+
+	return {
+		.size = ULARGE_INTEGER{attrb.nFileSizeLow, attrb.nFileSizeHigh}.QuadPart,
+		.last_write = ULARGE_INTEGER{attrb.ftLastWriteTime.dwLowDateTime, attrb.ftLastWriteTime.dwHighDateTime}.QuadPart,
+	};
+}
+
+str get_full_path(const char * path)
+{
+	char full_path[1024];
+	DWORD const length = GetFullPathNameA(path, sizeof(full_path), full_path, nullptr);
+	if (length == 0 or length >= sizeof(full_path)) return path;
+	return full_path;
+}
+
+// returns nullptr on failure, free with UnmapViewOfFile. A copy_on_write mapping is writable but never changes the file.
+u8 * map_file(const char * path, bool copy_on_write, u64 & size)
+{
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return nullptr;
+
+	LARGE_INTEGER file_size;
+	if (not GetFileSizeEx(file, &file_size) or file_size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return nullptr;
+	}
+	size = file_size.QuadPart;
+
+	// the view keeps the mapping and the file alive
+	HANDLE mapping = CreateFileMappingA(file, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (not mapping) return nullptr;
+
+	void * view = MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+
+	return (u8 *)view;
+}
+
+const char * const dll_dir = "build_dll\\";
+
+const char * const dll_build_mode = "rel"; // see build_dll.bat, "deb" to debug processes
+
+// build_dll keeps a pch per compile flags, pgi and pgo share one
+str pch_name(const char * mode, const char * arch)
+{
+	str name = strcmp(mode, "pgi") == 0 ? "pgo" : mode;
+	if (arch[0]) name += '_', name += arch;
+	return name;
+}
+
+str pch_rel_path(str const & pch_name)
+{ return dll_dir + pch_name + ".pch"; }
+
+str pch_dependencies_rel_path(str const & pch_name)
+{ return dll_dir + ("pch_" + pch_name) + ".json"; }
+
+str dll_rel_path(const char * dll_name)
+{
+	str path = dll_dir;
+	path += dll_name;
+	path += ".dll";
+	return path;
+}
+
+// build_dll writes the files each compile read with /sourceDependencies
+str dll_dependencies_rel_path(const char * dll_name)
+{
+	str path = dll_dir;
+	path += dll_name;
+	path += ".json";
+	return path;
+}
+
+// <proc file name>_<hash of key>, the proc's name is kept to find its files in build_dll
+str hashed_dll_name(strview cpp_path, str const & key)
+{
+	char hash[17];
+	sprintf_s(hash, "%016llx", fnv1a(key.data(), key.size()));
+
+	strview const file_name = cpp_path.substr(cpp_path.find_last_of("\\/") + 1);
+	return str(file_name.substr(0, file_name.rfind('.'))) + '_' + hash;
+}
+
+// "Source" and "Includes" of a /sourceDependencies json as full paths, empty if it doesn't exist yet
+std::vector<str> read_source_dependencies(const char * json_path)
+{
+	std::vector<str> paths;
+
+	FILE * file = fopen(json_path, "rb");
+	if (not file) return paths;
+	str json;
+	char buffer[4 << 10];
+	for (size_t size; (size = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+		json.append(buffer, size);
+	fclose(file);
+
+	// idx is on the opening quote, ends after the closing one
+	auto const read_string = [&json](size_t & idx)
+	{
+		str string;
+		for (++idx; idx < json.size() and json[idx] != '"'; ++idx)
+		{
+			if (json[idx] == '\\') ++idx; // paths only escape \\ and \"
+			string += json[idx];
+		}
+		++idx;
+		return get_full_path(string.c_str());
+	};
+
+	size_t idx = json.find("\"Source\"");
+	if (idx != str::npos)
+	{
+		idx = json.find('"', json.find(':', idx));
+		paths.push_back(read_string(idx));
+	}
+
+	idx = json.find("\"Includes\"");
+	if (idx != str::npos)
+	{
+		size_t const end = json.find(']', idx);
+		idx = json.find('[', idx);
+		while ((idx = json.find('"', idx)) < end)
+			paths.push_back(read_string(idx));
+	}
+
+	return paths;
+}
+
+u64 get_files_last_write(std::vector<str> const & paths)
+{
+	u64 last_write = 0;
+	for (str const & path : paths)
+		last_write = max(last_write, get_file_stamp(path.c_str()).last_write);
+	return last_write;
+}
+
+// newest write time of the proc and everything its last build of dll_name read
+u64 get_sources_last_write(const char * cpp_abs_path, const char * dll_name)
+{
+	u64 const includes_time = get_files_last_write(read_source_dependencies(dll_dependencies_rel_path(dll_name).c_str()));
+	return max(get_file_last_write(cpp_abs_path), includes_time);
+}
 
-bool build_process(const char * cpp_abs_path, bool check_write_times)
+// A dll is rebuilt if the proc, anything it included or the pch changed since the last build.
+// The pch is deleted when one of its headers changed, build_dll rebuilds it when it is missing.
+bool build_process(const char * cpp_abs_path, const char * dll_name, bool check_write_times, const char * mode = dll_build_mode, const char * arch = "")
 {
 	bool should_build = true;
 
 	if (check_write_times)
 	{
-		u64 last_compile_time = get_file_last_write(dll_rel_path);
-		u64 last_change_time = get_file_last_write(cpp_abs_path);
-		should_build = last_change_time > last_compile_time;
+		str const pch = pch_name(mode, arch);
+		u64 const pch_time = get_file_stamp(pch_rel_path(pch).c_str()).last_write;
+		bool const is_pch_stale = pch_time != 0 and get_files_last_write(read_source_dependencies(pch_dependencies_rel_path(pch).c_str())) > pch_time;
+		if (is_pch_stale) remove(pch_rel_path(pch).c_str());
+
+		u64 const last_compile_time = get_file_stamp(dll_rel_path(dll_name).c_str()).last_write;
+		u64 const last_change_time = max(get_sources_last_write(cpp_abs_path, dll_name), pch_time);
+		should_build = is_pch_stale or last_change_time > last_compile_time;
 	}
 
 	if (should_build)
@@ -79,7 +252,7 @@ bool build_process(const char * cpp_abs_path, bool check_write_times)
 		TimeScope("Build DLL");
 
 		char command[1024];
-		sprintf_s(command, "build_dll %s", cpp_abs_path);
+		sprintf_s(command, "build_dll %s %s %s %s", cpp_abs_path, dll_name, mode, arch);
 
 		str out;
 		i32 exit_code;
@@ -94,343 +267,2055 @@ bool build_process(const char * cpp_abs_path, bool check_write_times)
 	return true;
 }
 
-void apply_process(Image const & orig_img, Image & proc_img)
+/* Tuned builds
+ A proc can be built with profile guided optimization and the best /arch of this CPU (see main --tune).
+ The result is kept per proc and CPU in build_dll\tuned\, and is used instead of a rel build while it is
+ newer than the proc and everything it includes.
+*/
+const char * const tuned_dir = "build_dll\\tuned\\";
+
+struct CpuInfo
 {
-	TimeScope("Apply process");
+	str brand;
+	const char * arch; // for /arch, empty is the default (SSE2)
+};
+
+CpuInfo const & get_cpu_info()
+{
+	static CpuInfo const info = []
+	{
+		i32 regs[4];
+		char brand[49] = {};
+		__cpuid(regs, 0x80000000);
+		if (u32(regs[0]) >= 0x80000004)
+			for (i32 i = 0; i < 3; ++i)
+				__cpuid((i32 *)(brand + 16 * i), 0x80000002 + i);
+
+		// the OS must save the wider registers too (OSXSAVE, then XCR0)
+		__cpuid(regs, 1);
+		bool const has_avx = (regs[2] & (1 << 27)) and (regs[2] & (1 << 28)) and (_xgetbv(0) & 0x06) == 0x06;
+		__cpuidex(regs, 7, 0);
+		bool const has_avx2 = has_avx and (regs[1] & (1 << 5));
+		bool const has_avx512 = has_avx2 and (regs[1] & (1 << 16)) and (_xgetbv(0) & 0xe6) == 0xe6;
+
+		return CpuInfo{brand, has_avx512 ? "AVX512" : (has_avx2 ? "AVX2" : "")};
+	}();
+	return info;
+}
+
+// tuned\<proc name>_<hash of the proc path and the cpu>
+str tuned_dll_name(const char * cpp_abs_path)
+{
+	CpuInfo const & cpu = get_cpu_info();
+	return "tuned\\" + hashed_dll_name(cpp_abs_path, str(cpp_abs_path) + '#' + cpu.brand + '#' + cpu.arch);
+}
+
+bool is_tuned_dll_fresh(const char * cpp_abs_path, const char * dll_name)
+{
+	u64 const dll_time = get_file_stamp(dll_rel_path(dll_name).c_str()).last_write;
+	u64 const pch_headers_time = get_files_last_write(read_source_dependencies(pch_dependencies_rel_path(pch_name("pgo", get_cpu_info().arch)).c_str()));
+	return dll_time != 0 and dll_time >= max(get_sources_last_write(cpp_abs_path, dll_name), pch_headers_time);
+}
+
+struct Process
+{
+	HMODULE dll;
+	f_init * init;
+	f_process * process;
+	f_alloc_stats * alloc_stats;
+	ProcessTraits traits;
+	u64 key; // the dll, its last write and the args, same key and same input means same output
+};
+
+Process load_process(const char * dll_name, const char * args)
+{
+	str const dll_path = dll_rel_path(dll_name);
+
+	Process process;
+	process.dll = LoadLibraryA(dll_path.c_str());
+	if (not process.dll) exit_err("Can't load library from '%s'", dll_path.c_str());
+
+	process.init = (f_init *)GetProcAddress(process.dll, EXPORTED_INIT_NAME_STR);
+	if (not process.init) exit_err("Can't find " EXPORTED_INIT_NAME_STR " in dll");
+
+	process.process = (f_process *)GetProcAddress(process.dll, EXPORTED_PROCESS_NAME_STR);
+	if (not process.process) exit_err("Can't find " EXPORTED_PROCESS_NAME_STR " in dll");
+
+	auto set_args = (f_set_args *)GetProcAddress(process.dll, EXPORTED_SET_ARGS_NAME_STR);
+	if (not set_args) exit_err("Can't find " EXPORTED_SET_ARGS_NAME_STR " in dll");
+
+	auto get_traits = (f_traits *)GetProcAddress(process.dll, EXPORTED_TRAITS_NAME_STR);
+	if (not get_traits) exit_err("Can't find " EXPORTED_TRAITS_NAME_STR " in dll");
+
+	process.alloc_stats = (f_alloc_stats *)GetProcAddress(process.dll, EXPORTED_ALLOC_STATS_NAME_STR);
+	if (not process.alloc_stats) exit_err("Can't find " EXPORTED_ALLOC_STATS_NAME_STR " in dll");
+
+	set_args(args);
+	get_traits(process.traits);
+	if (process.traits.pointwise) process.traits.halo = 0;
+
+	FileStamp const stamp = get_file_stamp(dll_path.c_str());
+	str const key = dll_path + '#' + args;
+	process.key = fnv1a(&stamp, sizeof(stamp), fnv1a(key.data(), key.size()));
+
+	return process;
+}
+
+void free_process(Process & process)
+{
+	FreeLibrary(process.dll);
+	process.dll = nullptr;
+}
+
+/* Allocation stats
+ Every dll counts its own operator new/delete (see process_wrapper.cpp), a run resets them first.
+ For several processes the peaks are summed, an upper bound since they don't all peak at once.
+ Tuned (pgi/pgo) builds don't count, the timed code is the same as the shipped one.
+*/
+void reset_alloc_stats(std::vector<Process> const & processes)
+{
+	AllocStats ignored;
+	for (Process const & process : processes)
+		process.alloc_stats(ignored, true);
+}
+
+AllocStats get_alloc_stats(std::vector<Process> const & processes)
+{
+	AllocStats total;
+	for (Process const & process : processes)
+	{
+		AllocStats stats;
+		process.alloc_stats(stats, false);
+		total.is_counted = total.is_counted or stats.is_counted;
+		total.current_bytes += stats.current_bytes;
+		total.peak_bytes += stats.peak_bytes;
+		total.count += stats.count;
+		total.largest_bytes = max(total.largest_bytes, stats.largest_bytes);
+	}
+	return total;
+}
+
+void print_alloc_stats(AllocStats const & stats)
+{
+	if (is_quiet) return;
+	if (not stats.is_counted) return (void)printf("[Memory] not counted in tuned builds\n");
+
+	f64 const mb = 1 << 20;
+	printf("[Memory] peak %.2f MB | %llu allocations | largest %.2f MB", stats.peak_bytes / mb, stats.count, stats.largest_bytes / mb);
+	// blocks allocated outside the dll and freed in it
+	if (stats.current_bytes < 0) printf(" | freed %.2f MB more than allocated", -stats.current_bytes / mb);
+	printf("\n");
+}
+
+/* Pipelines
+ A .pipe file lists the processes to run in order, one per line: `<proc_path> [name=value ...]`
+ Relative proc paths are relative to the .pipe file, empty lines and lines starting with # are skipped.
+ Consecutive pointwise processes are fused, each band of rows goes through all of them while it is in cache.
+*/
+struct PipelineStage
+{
+	str proc_abs_path;
+	str args;
+	str dll_name;
+	bool is_tuned = false; // built by --tune, never rebuilt here
+};
+
+// path as is if it is absolute, otherwise relative to dir (which ends with a separator)
+str resolve_path(strview dir, strview path)
+{
+	bool const is_abs_path = path.size() > 1 and (path[1] == ':' or path[0] == '\\' or path[0] == '/');
+	str resolved;
+	if (not is_abs_path) resolved = dir;
+	resolved += path;
+	return resolved;
+}
+
+bool load_pipeline(const char * pipe_abs_path, std::vector<PipelineStage> & stages)
+{
+	FILE * file = fopen(pipe_abs_path, "r");
+	if (not file)
+	{
+		print_err("[Error] Can't open pipeline \"%s\".\n", pipe_abs_path);
+		return false;
+	}
+
+	strview const pipe_path = pipe_abs_path;
+	strview const pipe_dir = pipe_path.substr(0, pipe_path.find_last_of("\\/") + 1);
+
+	stages.clear();
+	char line[1024];
+	while (fgets(line, sizeof(line), file))
+	{
+		strview view = line;
+		size_t const begin = view.find_first_not_of(" \t\r\n");
+		if (begin == strview::npos or view[begin] == '#') continue;
+		view = view.substr(begin, view.find_last_not_of(" \t\r\n") + 1 - begin);
+
+		size_t const path_end = min(view.find(' '), view.size());
+		strview const path = view.substr(0, path_end);
+
+		PipelineStage stage;
+		stage.proc_abs_path = resolve_path(pipe_dir, path);
+		if (path_end < view.size()) stage.args = view.substr(path_end + 1);
+
+		// every stage gets its own dll, so the same process can appear twice with different args
+		stage.dll_name = hashed_dll_name(path, stage.proc_abs_path + '#' + std::to_string(stages.size()));
+
+		stages.push_back(std::move(stage));
+	}
+	fclose(file);
+
+	if (stages.empty())
+	{
+		print_err("[Error] Pipeline \"%s\" has no stages.\n", pipe_abs_path);
+		return false;
+	}
+
+	return true;
+}
+
+// Keeps intermediate images between stages and runs, so pipelines don't allocate every time
+struct ImagePool
+{
+	std::vector<Image> images;
+
+	Image acquire(i32 x, i32 y)
+	{
+		for (size_t i = 0; i < images.size(); ++i)
+			if (images[i].x == x and images[i].y == y)
+			{
+				Image image = std::move(images[i]);
+				images.erase(images.begin() + i);
+				return image;
+			}
+
+		return {x, y, nullptr};
+	}
+
+	void release(Image && image) { images.push_back(std::move(image)); }
+} image_pool;
+
+constexpr i32 pipeline_band_bytes = 256 << 10; // about the size of L2
+
+/* Dirty bands
+ A group of stages whose processes declare a halo (pointwise ones have 0) keeps its last output.
+ Its source is hashed in bands of dirty_band_rows, on the next run with the same key only the bands
+ that changed, widened by the halo, are processed again and the rest is copied from the last output.
+ Editing a small area of an image, or frames of a mostly still sequence, only pay for what changed.
+ Only the window and --sequence enable it, one-shot runs (workers, --regress, --tune) would only pay for it.
+*/
+constexpr i32 dirty_band_rows = 16;
+constexpr u64 dirty_cache_max_bytes = u64(256) << 20; // all kept outputs together, the least recently used go first
+
+// hashing and keeping outputs only pays off where runs repeat in one process, the window and --sequence
+bool is_dirty_cache_enabled = false;
+i64 dirty_reused_rows = 0; // copied from kept outputs instead of processed, over all runs
+
+struct DirtyCache
+{
+	u64 key;
+	std::vector<u64> band_hashes; // empty until the first run is done
+	Image output;
+};
+std::vector<DirtyCache> dirty_caches; // the most recently used is at the back
+
+u64 get_dirty_cache_bytes()
+{
+	u64 bytes = 0;
+	for (DirtyCache const & cache : dirty_caches)
+		bytes += u64(cache.output.x) * cache.output.y * sizeof(u8x4);
+	return bytes;
+}
+
+// nullptr if an output of this size can't be kept
+DirtyCache * get_dirty_cache(u64 key, i32 x, i32 y)
+{
+	u64 const bytes = u64(x) * y * sizeof(u8x4);
+	if (bytes > dirty_cache_max_bytes) return nullptr;
+
+	for (size_t i = 0; i < dirty_caches.size(); ++i)
+		if (dirty_caches[i].key == key)
+		{
+			std::rotate(dirty_caches.begin() + i, dirty_caches.begin() + i + 1, dirty_caches.end());
+			break;
+		}
+
+	if (dirty_caches.empty() or dirty_caches.back().key != key)
+		dirty_caches.push_back({.key = key});
+
+	if (dirty_caches.back().output.x != x or dirty_caches.back().output.y != y)
+		dirty_caches.back() = {.key = key};
+
+	bool const is_new = not dirty_caches.back().output.pixels;
+	while (dirty_caches.size() > 1 and get_dirty_cache_bytes() + (is_new ? bytes : 0) > dirty_cache_max_bytes)
+		dirty_caches.erase(dirty_caches.begin());
+
+	DirtyCache & cache = dirty_caches.back();
+	if (is_new) cache.output = Image(x, y, nullptr);
+	return &cache;
+}
+
+// FNV-1a over 64 bit words instead of bytes, folded so a change in the high bits reaches the low ones
+std::vector<u64> hash_bands(Image const & image)
+{
+	i32 const band_count = (image.y + dirty_band_rows - 1) / dirty_band_rows;
+	std::vector<u64> hashes(band_count);
+
+	#pragma omp parallel for schedule(static)
+	for (i32 band = 0; band < band_count; ++band)
+	{
+		i32 const y_begin = band * dirty_band_rows;
+		i32 const y_end = min(y_begin + dirty_band_rows, image.y);
+		u8 const * bytes = (u8 const *)(image.pixels.things + y_begin * image.x);
+		size_t const size = size_t(y_end - y_begin) * image.x * sizeof(u8x4);
+
+		u64 hash = 0xcbf29ce484222325;
+		size_t i = 0;
+		for (; i + sizeof(u64) <= size; i += sizeof(u64))
+		{
+			u64 word;
+			memcpy(&word, bytes + i, sizeof(u64));
+			hash = (hash ^ word) * 0x100000001b3;
+			hash ^= hash >> 32;
+		}
+		hashes[band] = fnv1a(bytes + i, size - i, hash);
+	}
+
+	return hashes;
+}
 
-	HMODULE dll = LoadLibraryA(dll_rel_path);
-	if (not dll) exit_err("Can't load library from '%s'", dll_rel_path);
+struct RowRange { i32 begin, end; };
 
-	auto init = (f_init *)GetProcAddress(dll, EXPORTED_INIT_NAME_STR);
-	if (not init) exit_err("Can't find " EXPORTED_INIT_NAME_STR " in dll");
+// bands whose source changed, widened by halo rows, merged into ranges
+std::vector<RowRange> get_dirty_ranges(std::vector<u64> const & last_hashes, std::vector<u64> const & hashes, i32 halo, i32 y)
+{
+	i32 const band_count = i32(hashes.size());
+	i32 const halo_bands = (halo + dirty_band_rows - 1) / dirty_band_rows;
+
+	std::vector<bool> is_dirty(band_count, false);
+	for (i32 band = 0; band < band_count; ++band)
+		if (hashes[band] != last_hashes[band])
+			for (i32 b = max(0, band - halo_bands); b < min(band_count, band + halo_bands + 1); ++b)
+				is_dirty[b] = true;
+
+	std::vector<RowRange> ranges;
+	for (i32 band = 0; band < band_count; ++band)
+	{
+		if (not is_dirty[band]) continue;
+		i32 const y_begin = band * dirty_band_rows;
+		i32 const y_end = min(y_begin + dirty_band_rows, y);
+		if (not ranges.empty() and ranges.back().end == y_begin) ranges.back().end = y_end;
+		else ranges.push_back({y_begin, y_end});
+	}
+	return ranges;
+}
 
-	auto process = (f_process *)GetProcAddress(dll, EXPORTED_PROCESS_NAME_STR);
-	if (not process) exit_err("Can't find " EXPORTED_PROCESS_NAME_STR " in dll");
+// runs already loaded processes, every group reads src and writes dst, then they ping-pong. The last group writes into proc_img.
+// returns the allocations the processes made during the run
+AllocStats run_pipeline(std::vector<Process> const & processes, Image const & orig_img, Image & proc_img)
+{
+	reset_alloc_stats(processes);
 
-	orig_img.blit_into(proc_img);
+	Image src = orig_img.rows(0, orig_img.y);
+	Image intermediate;
 
+	for (size_t begin = 0; begin < processes.size();)
 	{
-		printf("// DLL Begin \\\\\n");
-		init(orig_img);
+		size_t end = begin + 1;
+		bool const is_fused = processes[begin].traits.pointwise;
+		if (is_fused)
+			while (end < processes.size() and processes[end].traits.pointwise) ++end;
+
+		bool const is_last = end == processes.size();
+		Image dst = is_last ? proc_img.rows(0, proc_img.y) : image_pool.acquire(src.x, src.y);
+
+		// a halo of -1 means the group needs the whole image, it always runs over all of it
+		i32 const halo = is_fused ? 0 : processes[begin].traits.halo;
+		std::vector<RowRange> ranges = {{0, src.y}};
+		DirtyCache * cache = nullptr;
+		std::vector<u64> hashes;
+		if (halo >= 0 and is_dirty_cache_enabled)
+		{
+			u64 key = fnv1a(&begin, sizeof(begin));
+			for (size_t i = begin; i < end; ++i)
+				key = fnv1a(&processes[i].key, sizeof(u64), key);
+
+			cache = get_dirty_cache(key, src.x, src.y);
+			if (cache) hashes = hash_bands(src);
+			if (cache and not cache->band_hashes.empty())
+			{
+				ranges = get_dirty_ranges(cache->band_hashes, hashes, halo, src.y);
+
+				i32 dirty_rows = 0;
+				for (RowRange const & range : ranges) dirty_rows += range.end - range.begin;
+				if (not is_quiet) printf("[Dirty] %d of %d rows changed\n", dirty_rows, src.y);
+			}
+		}
+
+		if (not ranges.empty())
+			for (size_t i = begin; i < end; ++i)
+				processes[i].init(src);
+
+		if (is_fused)
+		{
+			TimeScope("Run fused stages");
+
+			i32 const band_rows = max(1, pipeline_band_bytes / i32(src.x * sizeof(u8x4)));
+			std::vector<RowRange> bands;
+			for (RowRange const & range : ranges)
+				for (i32 y = range.begin; y < range.end; y += band_rows)
+					bands.push_back({y, min(y + band_rows, range.end)});
+
+			#pragma omp parallel for schedule(dynamic)
+			for (i32 band = 0; band < i32(bands.size()); ++band)
+			{
+				Image dst_band = dst.rows(bands[band].begin, bands[band].end);
+				src.rows(bands[band].begin, bands[band].end).blit_into(dst_band);
+
+				for (size_t i = begin; i < end; ++i)
+					processes[i].process(dst_band, bands[band].begin);
+			}
+		}
+		else
+		{
+			TimeScope("Run stage");
+
+			for (RowRange const & range : ranges)
+			{
+				if (range.begin == 0 and range.end == src.y)
+				{
+					src.blit_into(dst);
+					processes[begin].process(dst, 0);
+					continue;
+				}
+
+				// the range with halo rows around it, only the range is kept
+				i32 const padded_begin = max(0, range.begin - halo);
+				i32 const padded_end = min(src.y, range.end + halo);
+				Image padded(src.x, padded_end - padded_begin, nullptr);
+				src.rows(padded_begin, padded_end).blit_into(padded);
+				processes[begin].process(padded, padded_begin);
+
+				Image dst_range = dst.rows(range.begin, range.end);
+				padded.rows(range.begin - padded_begin, range.end - padded_begin).blit_into(dst_range);
+			}
+		}
+
+		// the clean bands come from the last output, the recomputed ones go into it
+		if (cache)
+		{
+			std::vector<RowRange> clean;
+			i32 clean_begin = 0;
+			for (RowRange const & range : ranges)
+			{
+				if (clean_begin < range.begin) clean.push_back({clean_begin, range.begin});
+				clean_begin = range.end;
+			}
+			if (clean_begin < src.y) clean.push_back({clean_begin, src.y});
+
+			for (RowRange const & range : clean)
+			{
+				Image dst_range = dst.rows(range.begin, range.end);
+				cache->output.rows(range.begin, range.end).blit_into(dst_range);
+				dirty_reused_rows += range.end - range.begin;
+			}
+			for (RowRange const & range : ranges)
+			{
+				Image cached_range = cache->output.rows(range.begin, range.end);
+				dst.rows(range.begin, range.end).blit_into(cached_range);
+			}
+			cache->band_hashes = std::move(hashes);
+		}
+
+		if (intermediate.pixels) image_pool.release(std::move(intermediate));
+		src = dst.rows(0, dst.y);
+		if (not is_last) intermediate = std::move(dst);
+
+		begin = end;
+	}
+
+	return get_alloc_stats(processes);
+}
+
+void apply_process(const char * dll_name, Image const & orig_img, Image & proc_img)
+{
+	TimeScope("Apply process");
+
+	std::vector<Process> processes = {load_process(dll_name, "")};
+
+	printf("// DLL Begin \\\\\n");
+	AllocStats const alloc = run_pipeline(processes, orig_img, proc_img);
+	printf("\\\\  DLL End  //\n");
+
+	print_alloc_stats(alloc);
+	free_process(processes[0]);
+}
+
+void apply_pipeline(std::vector<PipelineStage> const & stages, Image const & orig_img, Image & proc_img)
+{
+	TimeScope("Apply pipeline");
+
+	std::vector<Process> processes;
+	for (PipelineStage const & stage : stages)
+		processes.push_back(load_process(stage.dll_name.c_str(), stage.args.c_str()));
 
-		TimeScope("Run process");
-		process(proc_img);
-		printf("\\\\  DLL End  //\n");
+	printf("// DLL Begin \\\\\n");
+	AllocStats const alloc = run_pipeline(processes, orig_img, proc_img);
+	printf("\\\\  DLL End  //\n");
+	print_alloc_stats(alloc);
+
+	for (Process & process : processes)
+		free_process(process);
+}
+
+// target is either a process (.cpp) or a pipeline (.pipe), a process is a single stage without args.
+// Every process is built into its own dll, a shared one would look up to date for a proc older than the last build.
+bool load_target(const char * target_abs_path, std::vector<PipelineStage> & stages)
+{
+	if (strview(target_abs_path).ends_with(".pipe")) return load_pipeline(target_abs_path, stages);
+
+	str const tuned_dll = tuned_dll_name(target_abs_path);
+	if (is_tuned_dll_fresh(target_abs_path, tuned_dll.c_str()))
+	{
+		if (not is_quiet) printf("Using the tuned build %s\n", tuned_dll.c_str());
+		stages = {PipelineStage{.proc_abs_path = target_abs_path, .dll_name = tuned_dll, .is_tuned = true}};
 	}
+	else
+		stages = {PipelineStage{.proc_abs_path = target_abs_path, .dll_name = hashed_dll_name(target_abs_path, target_abs_path)}};
+	return true;
+}
+
+bool build_target(const char * target_abs_path, bool check_write_times, std::vector<PipelineStage> & stages)
+{
+	if (not load_target(target_abs_path, stages)) return false;
+
+	for (PipelineStage const & stage : stages)
+		if (not stage.is_tuned and not build_process(stage.proc_abs_path.c_str(), stage.dll_name.c_str(), check_write_times)) return false;
+
+	return true;
+}
+
+bool build_and_apply(const char * target_abs_path, bool check_write_times, Image const & orig_img, Image & proc_img)
+{
+	std::vector<PipelineStage> stages;
+	if (not build_target(target_abs_path, check_write_times, stages)) return false;
 
-	FreeLibrary(dll);
+	if (not strview(target_abs_path).ends_with(".pipe"))
+		apply_process(stages[0].dll_name.c_str(), orig_img, proc_img);
+	else
+		apply_pipeline(stages, orig_img, proc_img);
+
+	return true;
 }
 
-wstr str_to_wstr(str const & str)
+// the target, its procs and every file they include from the project or the procs' directories
+// (system headers are left out). Dependencies are known after the first build.
+std::vector<str> get_target_dependencies(const char * target_abs_path)
 {
-	wstr wstr;
-	wstr.resize(MultiByteToWideChar(CP_UTF8, 0, str.c_str(), (int)str.size(), nullptr, 0));
-	MultiByteToWideChar(CP_UTF8, 0, str.data(), (int)str.size(), wstr.data(), (int)wstr.size());
-	return wstr;
+	std::vector<str> paths = {target_abs_path};
+	std::vector<str> dirs = {get_full_path(".\\")};
+
+	std::vector<PipelineStage> stages;
+	if (load_target(target_abs_path, stages))
+		for (PipelineStage const & stage : stages)
+		{
+			paths.push_back(stage.proc_abs_path);
+			dirs.push_back(stage.proc_abs_path.substr(0, stage.proc_abs_path.find_last_of("\\/") + 1));
+			for (str & path : read_source_dependencies(dll_dependencies_rel_path(stage.dll_name.c_str()).c_str()))
+				paths.push_back(std::move(path));
+		}
+	for (str & path : read_source_dependencies(pch_dependencies_rel_path(pch_name(dll_build_mode, "")).c_str()))
+		paths.push_back(std::move(path));
+
+	// paths are case insensitive, cl reports them lower case
+	auto const starts_with = [](strview path, strview prefix)
+	{
+		if (path.size() < prefix.size()) return false;
+		for (size_t i = 0; i < prefix.size(); ++i)
+			if (tolower(path[i]) != tolower(prefix[i]) and not (strchr("\\/", path[i]) and strchr("\\/", prefix[i]))) return false;
+		return true;
+	};
+
+	std::vector<str> dependencies;
+	for (str const & path : paths)
+	{
+		bool is_in_dirs = false;
+		for (str const & dir : dirs)
+			is_in_dirs |= starts_with(path, dir);
+		bool is_new = true;
+		for (str const & dependency : dependencies)
+			is_new &= not (dependency.size() == path.size() and starts_with(dependency, path));
+		if (is_in_dirs and is_new) dependencies.push_back(path);
+	}
+	return dependencies;
 }
 
-class FileWatcher
+/* Isolated workers
+ The processes run in a child process (main --worker <mapping_name> <target_abs_path>), a crash or a hang
+ there only costs that run. Both images live in a named shared memory mapping, the worker reads orig and
+ writes proc in place, nothing is copied between the processes. The host kills workers that take longer
+ than their timeout, by default it grows with the image so large images and slow processes get their time.
+*/
+constexpr DWORD worker_timeout_base_ms = 10'000;
+constexpr DWORD worker_timeout_per_megapixel_ms = 10'000;
+
+DWORD get_worker_timeout_ms(i32 x, i32 y)
+{ return worker_timeout_base_ms + DWORD(worker_timeout_per_megapixel_ms * (f64(x) * y / 1e6)); }
+constexpr size_t worker_header_size = 64;
+
+struct WorkerHeader
 {
-	static constexpr size_t buffer_size = 4 << 10;
-	unique_array<std::byte> buffer{new std::byte[buffer_size]};
-	wstr file_name;
-	HANDLE file_handle{INVALID_HANDLE_VALUE};
-	OVERLAPPED overlapped{.hEvent = INVALID_HANDLE_VALUE};
+	i32 x, y;
+	f64 run_ms; // written by the worker, init + process of all stages
+	AllocStats alloc; // written by the worker
+};
+static_assert(sizeof(WorkerHeader) <= worker_header_size);
+
+// orig and proc are views into the mapping
+struct SharedImages
+{
+	str name;
+	HANDLE mapping = nullptr;
+	u8 * view = nullptr;
+	Image orig, proc;
+
+	SharedImages() = default;
+	SharedImages(SharedImages const &) = delete;
+	~SharedImages()
+	{
+		orig = {}, proc = {};
+		if (view) UnmapViewOfFile(view);
+		if (mapping) CloseHandle(mapping);
+	}
+
+	static size_t size(i32 x, i32 y) { return worker_header_size + 2 * size_t(x) * y * sizeof(u8x4); }
+
+	WorkerHeader & header() const { return *(WorkerHeader *)view; }
+
+	void map_images()
+	{
+		auto const & header = *(WorkerHeader const *)view;
+		u8x4 * pixels = (u8x4 *)(view + worker_header_size);
+		auto const no_release = [](u8x4 *){};
+		orig = Image(header.x, header.y, std::move(pixels), no_release);
+		pixels = (u8x4 *)(view + worker_header_size) + header.x * header.y;
+		proc = Image(header.x, header.y, std::move(pixels), no_release);
+	}
+
+	// host side, copies orig_img into the mapping once
+	bool create(Image const & orig_img)
+	{
+		char mapping_name[64];
+		sprintf_s(mapping_name, "image_processor_%lu", GetCurrentProcessId());
+		name = mapping_name;
+
+		u64 const mapping_size = size(orig_img.x, orig_img.y);
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, DWORD(mapping_size >> 32), DWORD(mapping_size), name.c_str());
+		if (not mapping) return false;
+		view = (u8 *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		if (not view)
+		{
+			CloseHandle(mapping), mapping = nullptr;
+			return false;
+		}
+
+		header() = {orig_img.x, orig_img.y};
+		map_images();
+		orig_img.blit_into(orig);
+		return true;
+	}
+
+	// worker side
+	bool open(const char * mapping_name)
+	{
+		name = mapping_name;
+		mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, false, mapping_name);
+		if (not mapping) return false;
+		view = (u8 *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		if (not view) return false;
+
+		map_images();
+		return true;
+	}
+};
+
+// the child process, its exit code tells the host if the run succeeded
+int run_worker(const char * mapping_name, const char * target_abs_path)
+{
+	// a crash should end the worker, not wait on the error dialog until the watchdog fires
+	SetErrorMode(SEM_FAILCRITICALERRORS | SEM_NOGPFAULTERRORBOX);
+
+	SharedImages shared;
+	if (not shared.open(mapping_name)) exit_err("Worker can't open the shared images \"%s\"", mapping_name);
+
+	std::vector<PipelineStage> stages;
+	if (not load_target(target_abs_path, stages)) return EXIT_FAILURE;
+
+	std::vector<Process> processes;
+	for (PipelineStage const & stage : stages)
+		processes.push_back(load_process(stage.dll_name.c_str(), stage.args.c_str()));
+
+	printf("// DLL Begin (isolated) \\\\\n");
+	auto const begin = std::chrono::steady_clock::now();
+	shared.header().alloc = run_pipeline(processes, shared.orig, shared.proc);
+	shared.header().run_ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	printf("\\\\  DLL End  //\n");
+	fflush(stdout);
+
+	for (Process & process : processes)
+		free_process(process);
+
+	return EXIT_SUCCESS;
+}
+
+struct WorkerStats
+{
+	f64 run_ms = 0;
+	u64 peak_bytes = 0; // peak private bytes of the worker
+	AllocStats alloc; // of the processes
+};
+
+// the result is in shared.proc, a timeout_ms of 0 means get_worker_timeout_ms
+bool build_and_apply_isolated(const char * target_abs_path, bool check_write_times, SharedImages & shared, WorkerStats * stats = nullptr, DWORD timeout_ms = 0)
+{
+	std::vector<PipelineStage> stages;
+	if (not build_target(target_abs_path, check_write_times, stages)) return false;
+
+	TimeScope("Apply process (isolated)");
+
+	char exe_path[1024];
+	GetModuleFileNameA(nullptr, exe_path, sizeof(exe_path));
+	char command[4096];
+	sprintf_s(command, "\"%s\" --worker %s \"%s\"", exe_path, shared.name.c_str(), target_abs_path);
+
+	STARTUPINFOA startup_info{.cb = sizeof(STARTUPINFOA)};
+	PROCESS_INFORMATION worker;
+	if (not CreateProcessA(nullptr, command, nullptr, nullptr, false, 0, nullptr, nullptr, &startup_info, &worker))
+	{
+		print_err("[Error] Can't start the worker process, error %lu.\n", GetLastError());
+		return false;
+	}
+
+	if (timeout_ms == 0) timeout_ms = get_worker_timeout_ms(shared.orig.x, shared.orig.y);
+
+	bool is_succeeded = false;
+	if (WaitForSingleObject(worker.hProcess, timeout_ms) == WAIT_TIMEOUT)
+	{
+		TerminateProcess(worker.hProcess, EXIT_FAILURE);
+		WaitForSingleObject(worker.hProcess, INFINITE);
+		print_err("[Error] Timeout: the process didn't finish in %lu ms (%dx%d image), the worker is terminated.\n", timeout_ms, shared.orig.x, shared.orig.y);
+	}
+	else
+	{
+		DWORD exit_code;
+		GetExitCodeProcess(worker.hProcess, &exit_code);
+		is_succeeded = exit_code == EXIT_SUCCESS;
+		if (not is_succeeded) print_err("[Error] Worker failed with exit code 0x%08lx.\n", exit_code);
+	}
+
+	if (is_succeeded) print_alloc_stats(shared.header().alloc);
+
+	if (is_succeeded and stats)
+	{
+		PROCESS_MEMORY_COUNTERS counters{.cb = sizeof(PROCESS_MEMORY_COUNTERS)};
+		GetProcessMemoryInfo(worker.hProcess, &counters, sizeof(counters));
+		stats->run_ms = shared.header().run_ms;
+		stats->alloc = shared.header().alloc;
+		stats->peak_bytes = counters.PeakPagefileUsage;
+	}
+
+	CloseHandle(worker.hThread);
+	CloseHandle(worker.hProcess);
+	return is_succeeded;
+}
+
+#include "file_watcher.hpp"
+
+#pragma endregion
+
+#pragma region Graphics
+#include "qoi.hpp"
+
+/* Raw RGBA
+ A raw_header_size byte header followed by the pixels exactly as they are in memory,
+ so loading is mapping the file, no decoding or copying.
+*/
+constexpr size_t raw_header_size = 64;
+constexpr u32 raw_flag_bottom_up = 1 << 0; // first row in the file is the bottom of the image
+
+struct RawHeader
+{
+	char magic[4] = {'R', 'G', 'B', 'A'};
+	u32 flags = 0;
+	i32 x = 0, y = 0;
+	FileStamp source = {}; // set when the file is a decode cache of another image
+};
+static_assert(sizeof(RawHeader) <= raw_header_size);
+
+// a corrupt header must not size the pixels past the file, same limit as qoi
+bool is_raw_size_valid(RawHeader const & header)
+{ return header.x > 0 and header.y > 0 and u64(header.x) * u64(header.y) <= (u64(1) << 30); }
+
+void unmap_raw_pixels(u8x4 * pixels)
+{ UnmapViewOfFile((u8 *)pixels - raw_header_size); }
+
+// returns the error or nullptr on success
+const char * map_raw(const char * path, bool flip_vertically, RawHeader & header, Image & img)
+{
+	u64 size;
+	u8 * view = map_file(path, true, size);
+	if (not view) return "can't open the file";
+
+	if (size >= raw_header_size) memcpy(&header, view, sizeof(header));
+	const char * error = nullptr;
+	if (size < raw_header_size or memcmp(header.magic, RawHeader{}.magic, 4) != 0)
+		error = "not a raw RGBA file";
+	else if (not is_raw_size_valid(header))
+		error = "raw RGBA file has an invalid size";
+	else if (size < raw_header_size + u64(header.x) * header.y * sizeof(u8x4))
+		error = "raw RGBA file is truncated";
+	if (error)
+	{
+		UnmapViewOfFile(view);
+		return error;
+	}
+
+	u8x4 * pixels = (u8x4 *)(view + raw_header_size);
+
+	bool const is_bottom_up = header.flags & raw_flag_bottom_up;
+	if (is_bottom_up == flip_vertically)
+	{
+		img = Image(header.x, header.y, std::move(pixels), unmap_raw_pixels);
+		return nullptr;
+	}
+
+	// stored the other way around, flip into a copy
+	img = Image(header.x, header.y, nullptr);
+	for (i32 y = 0; y < img.y; ++y)
+		memcpy(img.pixels.things + y * img.x, pixels + (img.y - 1 - y) * img.x, img.x * sizeof(u8x4));
+	UnmapViewOfFile(view);
+	return nullptr;
+}
+
+Image load_raw(const char * path, bool flip_vertically)
+{
+	RawHeader header;
+	Image img;
+	if (const char * error = map_raw(path, flip_vertically, header, img))
+		exit_err("Can't load image \"%s\": %s", path, error);
+	return img;
+}
+
+bool save_raw(Image const & img, const char * path, bool flip_vertically, FileStamp source = {})
+{
+	FILE * file = fopen(path, "wb");
+	if (not file) return false;
+
+	u8 header_bytes[raw_header_size] = {};
+	RawHeader const header{.flags = flip_vertically ? raw_flag_bottom_up : 0, .x = img.x, .y = img.y, .source = source};
+	memcpy(header_bytes, &header, sizeof(header));
+
+	bool const is_written =
+		fwrite(header_bytes, raw_header_size, 1, file) == 1 and
+		fwrite(img.pixels, sizeof(u8x4), img.x * img.y, file) == size_t(img.x * img.y);
+	fclose(file);
+	return is_written;
+}
+
+Image load_qoi(const char * path, bool flip_vertically)
+{
+	u64 size;
+	u8 * view = map_file(path, false, size);
+	if (not view) exit_err("Can't open image file");
+
+	Image img;
+	bool const is_decoded = qoi_decode(view, size, flip_vertically, img);
+	UnmapViewOfFile(view);
+	if (not is_decoded) exit_err("Can't load image: malformed QOI file");
+
+	return img;
+}
+
+bool save_qoi(Image const & img, const char * path, bool flip_vertically)
+{
+	unique_array<u8> buffer{new u8[qoi_max_size(img)]};
+	size_t const size = qoi_encode(img, flip_vertically, buffer);
+
+	FILE * file = fopen(path, "wb");
+	if (not file) return false;
+	bool const is_written = fwrite(buffer, 1, size, file) == size;
+	fclose(file);
+	return is_written;
+}
+
+#define STBI_ONLY_JPEG
+#define STBI_ONLY_PNG
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb/image.h>
+
+/* Decode cache
+ png/jpeg decodes are kept as raw RGBA files in image_cache_dir, named by the hash of the full path.
+ The header records the source's size and last write time, a cache file is used only if they still match.
+ Both are stored in the flip_vertically orientation they were loaded with, so a hit is just a mapping.
+ Entries are written to a temp file and renamed over, an interrupted write never leaves a partial entry.
+ Past image_cache_max_bytes the oldest written entries are deleted.
+*/
+const char * const image_cache_dir = "build\\image_cache\\";
+constexpr u64 image_cache_max_bytes = u64(2) << 30;
+
+str image_cache_path(const char * path, bool flip_vertically)
+{
+	str const full_path = get_full_path(path);
+	char name[32];
+	sprintf_s(name, "%016llx%s.rgba", fnv1a(full_path.data(), full_path.size()), flip_vertically ? "" : "_top_down");
+	return str(image_cache_dir) + name;
+}
+
+bool load_cached_image(const char * path, bool flip_vertically, FileStamp source, Image & img)
+{
+	if (source.size == 0) return false;
+
+	str const cache_path = image_cache_path(path, flip_vertically);
+	if (get_file_stamp(cache_path.c_str()).size == 0) return false;
+
+	RawHeader header;
+	Image cached;
+	if (const char * error = map_raw(cache_path.c_str(), flip_vertically, header, cached))
+	{
+		print_err("[Error] Cached image \"%s\" is rejected: %s\n", cache_path.c_str(), error);
+		return false;
+	}
+	if (header.source != source) return false;
+
+	img = std::move(cached);
+	return true;
+}
+
+// deletes the oldest entries until the cache fits image_cache_max_bytes, mapped entries can't be deleted and are skipped
+void trim_image_cache()
+{
+	struct Entry { str path; u64 size, last_write; };
+	std::vector<Entry> entries;
+	u64 total_size = 0;
+
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileA((str(image_cache_dir) + "*.rgba").c_str(), &data);
+	if (find == INVALID_HANDLE_VALUE) return;
+	do
+	{
+		Entry entry{
+			.path = str(image_cache_dir) + data.cFileName,
+			.size = ULARGE_INTEGER{data.nFileSizeLow, data.nFileSizeHigh}.QuadPart,
+			.last_write = ULARGE_INTEGER{data.ftLastWriteTime.dwLowDateTime, data.ftLastWriteTime.dwHighDateTime}.QuadPart,
+		};
+		total_size += entry.size;
+		entries.push_back(std::move(entry));
+	}
+	while (FindNextFileA(find, &data));
+	FindClose(find);
+
+	std::sort(entries.begin(), entries.end(), [](Entry const & a, Entry const & b) { return a.last_write < b.last_write; });
+	for (Entry const & entry : entries)
+	{
+		if (total_size <= image_cache_max_bytes) break;
+		if (DeleteFileA(entry.path.c_str())) total_size -= entry.size;
+	}
+}
+
+void save_cached_image(const char * path, bool flip_vertically, FileStamp source, Image const & img)
+{
+	if (source.size == 0) return;
+
+	CreateDirectoryA("build", nullptr);
+	CreateDirectoryA(image_cache_dir, nullptr);
+	str const cache_path = image_cache_path(path, flip_vertically);
+	char temp_path[1024];
+	sprintf_s(temp_path, "%s.%lu.tmp", cache_path.c_str(), GetCurrentProcessId());
+
+	if (not save_raw(img, temp_path, flip_vertically, source) or not MoveFileExA(temp_path, cache_path.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		print_err("[Warning] Can't write image cache \"%s\".\n", cache_path.c_str());
+		DeleteFileA(temp_path); // don't leave a partial file behind
+		return;
+	}
+
+	trim_image_cache();
+}
+
+Image decode_image(const char * path, bool flip_vertically)
+{
+	FILE * image_file = fopen(path, "rb");
+	if (not image_file) exit_err("Can't open image file");
+
+	stbi_set_flip_vertically_on_load(flip_vertically);
+
+	int x, y, c;
+	stbi_uc * rgba_pixels = stbi_load_from_file(image_file, &x, &y, &c, 4);
+	if (not rgba_pixels) exit_err("Can't load image: %s", stbi_failure_reason());
+	fclose(image_file);
+
+	return {x, y, (u8x4 *)(rgba_pixels), [](u8x4 * pixels){ stbi_image_free(pixels); }};
+}
+
+// .qoi and .rgba are picked by extension, anything else goes to stb (png, jpeg) through the decode cache
+Image load_image(const char * path, bool flip_vertically = true, bool use_cache = true)
+{
+	strview const path_view = path;
+	if (path_view.ends_with(".qoi")) return load_qoi(path, flip_vertically);
+	if (path_view.ends_with(".rgba")) return load_raw(path, flip_vertically);
+	if (not use_cache) return decode_image(path, flip_vertically);
+
+	FileStamp const source = get_file_stamp(path);
+
+	Image img;
+	if (load_cached_image(path, flip_vertically, source, img))
+	{
+		printf("Loaded image from cache\n");
+		return img;
+	}
+
+	img = decode_image(path, flip_vertically);
+	save_cached_image(path, flip_vertically, source, img);
+	return img;
+}
+
+#include "png.hpp"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb/image_write.h>
+
+// extension picks the format (png, jpg, qoi, rgba).
+// png is encoded in parallel bands by png.hpp, jpg stays on stb (single threaded)
+bool write_image(Image const & img, const char * path, strview extension, bool flip_vertically = true)
+{
+	if (extension == "png")		return png_write(img, path, flip_vertically);
+	if (extension == "qoi")		return save_qoi(img, path, flip_vertically);
+	if (extension == "rgba")	return save_raw(img, path, flip_vertically);
+
+	stbi_flip_vertically_on_write(flip_vertically);
+	return stbi_write_jpg(path, img.x, img.y, 4, img.pixels, 100);
+}
+
+// saves next to path as <name>_processed.<extension>, empty extension keeps the extension of path
+void save_image(Image const & img, strview path, strview extension = {}, bool flip_vertically = true)
+{
+	size_t dot_idx = path.rfind('.');
+	if (extension.empty()) extension = path.substr(dot_idx + 1);
+
+	str new_path;
+	new_path.reserve(path.size() + 32);
+	new_path += path.substr(0, dot_idx);
+	new_path += "_processed.";
+	new_path += extension;
+
+	if (write_image(img, new_path.c_str(), extension, flip_vertically))	printf("Saved iamge to %s\n", new_path.c_str());
+	else			print_err("[Error] Failed to save image to %s\n", new_path.c_str());
+}
+
+// Saves on a background thread, it owns the snapshot so the caller can keep going.
+// One save at a time, a new save waits for the previous one.
+struct ImageSaver
+{
+	std::thread thread;
+
+	void save(Image && snapshot, str path, str extension)
+	{
+		wait();
+		thread = std::thread(
+			[snapshot = std::move(snapshot), path = std::move(path), extension = std::move(extension)]
+			{
+				TimeScope("Save");
+				save_image(snapshot, path, extension);
+			}
+		);
+	}
+
+	void wait()
+	{ if (thread.joinable()) thread.join(); }
+
+	~ImageSaver() { wait(); }
+} image_saver;
+
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+#include <glad/gl.h>
+
+struct TextureDesc
+{
+	int x, y;
+	u8x4 * pixels = nullptr;
+
+	GLenum min_filter = GL_LINEAR;
+	GLenum mag_filter = GL_LINEAR;
+
+	GLenum wrap_s = GL_CLAMP_TO_EDGE;
+	GLenum wrap_t = GL_CLAMP_TO_EDGE;
+};
+GLuint create_texture(TextureDesc const & desc)
+{
+	GLuint id;
+	glGenTextures(1, &id);
+
+	glBindTexture(GL_TEXTURE_2D, id);
+	glTexImage2D(GL_TEXTURE_2D,0, GL_RGBA8, desc.x, desc.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, desc.pixels);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, desc.min_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, desc.mag_filter);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glGenerateMipmap(GL_TEXTURE_2D);
+
+	return id;
+}
+
+void upload_texture(GLuint tex, Image const & img)
+{
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, img.x, img.y, GL_RGBA, GL_UNSIGNED_BYTE, img.pixels);
+}
+
+void download_texture(GLuint tex, Image & img)
+{
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, img.pixels);
+}
+
+void gl_debug_callback(
+	GLenum source, GLenum type, GLuint id, GLenum severity,
+	GLsizei length, const GLchar * message, const void * userParam
+)
+{
+	const char * source_str;
+	switch (source)
+	{
+	case GL_DEBUG_SOURCE_API:				source_str = "API";break;
+	case GL_DEBUG_SOURCE_WINDOW_SYSTEM:		source_str = "Window System";break;
+	case GL_DEBUG_SOURCE_SHADER_COMPILER:	source_str = "Shader Compiler";break;
+	case GL_DEBUG_SOURCE_THIRD_PARTY:		source_str = "Third Party";break;
+	case GL_DEBUG_SOURCE_APPLICATION:		source_str = "Application";break;
+	case GL_DEBUG_SOURCE_OTHER:				source_str = "Other";break;
+	default: break;
+	}
+	const char * type_str;
+	switch (type)
+	{
+	case GL_DEBUG_TYPE_ERROR:				type_str = "Error";break;
+	case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR:	type_str = "Deprecated Behaviour";break;
+	case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:	type_str = "Undefined Behaviour";break;
+	case GL_DEBUG_TYPE_PORTABILITY:			type_str = "Portability";break;
+	case GL_DEBUG_TYPE_PERFORMANCE:			type_str = "Performance";break;
+	case GL_DEBUG_TYPE_MARKER:				type_str = "Marker";break;
+	case GL_DEBUG_TYPE_PUSH_GROUP:			type_str = "Push Group";break;
+	case GL_DEBUG_TYPE_POP_GROUP:			type_str = "Pop Group";break;
+	case GL_DEBUG_TYPE_OTHER:				type_str = "Other";break;
+	default: break;
+	}
+	const char * severity_str;
+	switch (severity)
+	{
+	case GL_DEBUG_SEVERITY_HIGH: 			severity_str = " !!!"; break;
+	case GL_DEBUG_SEVERITY_MEDIUM: 			severity_str = " !!"; break;
+	case GL_DEBUG_SEVERITY_LOW: 			severity_str = " !"; break;
+	case GL_DEBUG_SEVERITY_NOTIFICATION:	severity_str = ""; break;
+	default: break;
+	}
+
+	print_err("GL[%s %s%s]", source_str, type_str, severity_str);
+	print_err(" %i: %s%c", id, message, (message[length - 2] != '\n' ? '\n' : '\0'));
+}
+
+
+GLuint blit_program;
+
+void init_blit_program()
+{
+	blit_program = glCreateProgram();
+	
+	GLuint vert = glCreateShader(GL_VERTEX_SHADER);
+	const char * vert_src = R"VERT(#version 330
+out vec2 uv;
+
+void main()
+{
+//  2
+//  |`.
+//  |  `.
+//  |----`.
+//  |    | `.
+//  '----'----
+//  0         1
+//
+//  gl_VertexID = 0  =>  gl_Position = (-1, -1, 1, 1) | uv = (0, 0)
+//  gl_VertexID = 1  =>  gl_Position = (+3, -1, 1, 1) | uv = (2, 0)
+//  gl_VertexID = 2  =>  gl_Position = (-1, +3, 1, 1) | uv = (0, 2)
+
+    gl_Position = vec4(
+        gl_VertexID == 1 ? 3 : -1,
+        gl_VertexID == 2 ? 3 : -1,
+        1,
+        1
+    );
+
+    uv = vec2(
+        gl_VertexID == 1 ? 2 : 0,
+        gl_VertexID == 2 ? 2 : 0
+    );
+}
+	)VERT";
+	glShaderSource(vert, 1, &vert_src, 0);
+	glCompileShader(vert);
+	
+	GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
+	const char * frag_src = R"FRAG(#version 330
+in vec2 uv;
+
+uniform sampler2D tex;
+
+out vec4 color;
+
+void main()
+{
+	color = texture(tex, uv);
+}
+	)FRAG";
+	glShaderSource(frag, 1, &frag_src, 0);
+	glCompileShader(frag);
+
+	glAttachShader(blit_program, vert);
+	glAttachShader(blit_program, frag);
+	glLinkProgram(blit_program);
+
+	glUseProgram(blit_program);
+	glUniform1i(glGetUniformLocation(blit_program, "tex"), 0);
+}
+
+void blit_texture(GLuint tex)
+{
+	glUseProgram(blit_program);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, tex);
+
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+#pragma endregion
+
+#pragma region Sequence
+
+/* Sequences
+ main --sequence <input> <output> <proc_path>
+ Runs the process (or .pipe) over every frame of input and writes them to output. Both are either
+ a printf pattern of numbered images (frames\frame_%04d.png, any image format), a raw RGBA stream
+ (.rgba, one raw header then the frames back to back) or a .y4m video.
+
+ Decoding, processing and encoding run on their own threads: frame N+1 is decoded while N is
+ processed and N-1 is encoded. Frames move between them through a fixed ring of slots, so memory
+ stays the same however long the sequence is. The first frame runs alone, the ring gets as many
+ slots (2 to sequence_ring_size) as fit into sequence_memory_budget next to the process' peak allocations
+ and the outputs kept for dirty bands.
+*/
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+constexpr i32 sequence_ring_size = 4; // one slot per stage plus one to absorb jitter
+constexpr u64 sequence_memory_budget = u64(1) << 30; // frames in flight plus what the process allocates
+
+enum class SequenceKind { Numbered, Raw, Y4m };
+
+SequenceKind get_sequence_kind(strview path)
+{
+	if (path.ends_with(".rgba")) return SequenceKind::Raw;
+	if (path.ends_with(".y4m")) return SequenceKind::Y4m;
+	return SequenceKind::Numbered;
+}
+
+struct Y4mFormat
+{
+	i32 x = 0, y = 0;
+	bool is_420 = true; // otherwise 4:4:4
+	str frame_rate = "30:1";
+
+	i32 chroma_x() const { return is_420 ? (x + 1) / 2 : x; }
+	i32 chroma_y() const { return is_420 ? (y + 1) / 2 : y; }
+	size_t frame_size() const { return size_t(x) * y + 2 * size_t(chroma_x()) * chroma_y(); }
+};
+
+// BT.601, limited range. Planes are top to bottom, frames are bottom up like every loaded image.
+void yuv_to_rgba(u8 const * planes, Y4mFormat const & format, Image & frame)
+{
+	u8 const * plane_y = planes;
+	u8 const * plane_u = plane_y + size_t(format.x) * format.y;
+	u8 const * plane_v = plane_u + size_t(format.chroma_x()) * format.chroma_y();
+
+	for (i32 row = 0; row < format.y; ++row)
+	{
+		u8x4 * dst = frame.pixels.things + (format.y - 1 - row) * format.x;
+		i32 const chroma_row = format.is_420 ? row / 2 : row;
+		for (i32 i = 0; i < format.x; ++i)
+		{
+			i32 const chroma_idx = chroma_row * format.chroma_x() + (format.is_420 ? i / 2 : i);
+			f32 const y = 1.164f * (plane_y[row * format.x + i] - 16);
+			f32 const u = plane_u[chroma_idx] - 128.f;
+			f32 const v = plane_v[chroma_idx] - 128.f;
+			dst[i][0] = u8(clamp(y + 1.596f * v + 0.5f, 0.f, 255.f));
+			dst[i][1] = u8(clamp(y - 0.392f * u - 0.813f * v + 0.5f, 0.f, 255.f));
+			dst[i][2] = u8(clamp(y + 2.017f * u + 0.5f, 0.f, 255.f));
+			dst[i][3] = 255;
+		}
+	}
+}
+
+// 4:2:0 chroma is the average of each 2x2 block
+void rgba_to_yuv(Image const & frame, Y4mFormat const & format, u8 * planes)
+{
+	u8 * plane_y = planes;
+	u8 * plane_u = plane_y + size_t(format.x) * format.y;
+	u8 * plane_v = plane_u + size_t(format.chroma_x()) * format.chroma_y();
+	i32 const step = format.is_420 ? 2 : 1;
+
+	auto const pixel = [&](i32 row, i32 i) -> u8x4 const & { return frame.pixels[(format.y - 1 - row) * format.x + i]; };
+
+	for (i32 row = 0; row < format.y; ++row)
+		for (i32 i = 0; i < format.x; ++i)
+		{
+			u8x4 const & p = pixel(row, i);
+			plane_y[row * format.x + i] = u8(16.5f + 0.257f * p[0] + 0.504f * p[1] + 0.098f * p[2]);
+		}
+
+	for (i32 chroma_row = 0; chroma_row < format.chroma_y(); ++chroma_row)
+		for (i32 chroma_i = 0; chroma_i < format.chroma_x(); ++chroma_i)
+		{
+			f32 r = 0, g = 0, b = 0;
+			for (i32 dy = 0; dy < step; ++dy)
+				for (i32 dx = 0; dx < step; ++dx)
+				{
+					u8x4 const & p = pixel(min(chroma_row * step + dy, format.y - 1), min(chroma_i * step + dx, format.x - 1));
+					r += p[0], g += p[1], b += p[2];
+				}
+			f32 const inv_count = 1.f / f32(step * step);
+			r *= inv_count, g *= inv_count, b *= inv_count;
+
+			i32 const chroma_idx = chroma_row * format.chroma_x() + chroma_i;
+			plane_u[chroma_idx] = u8(clamp(128.5f - 0.148f * r - 0.291f * g + 0.439f * b, 0.f, 255.f));
+			plane_v[chroma_idx] = u8(clamp(128.5f + 0.439f * r - 0.368f * g - 0.071f * b, 0.f, 255.f));
+		}
+}
+
+bool read_y4m_header(FILE * file, Y4mFormat & format)
+{
+	char line[1024];
+	if (not fgets(line, sizeof(line), file) or strncmp(line, "YUV4MPEG2 ", 10) != 0) return false;
+
+	strview params = line + 10;
+	while (not params.empty())
+	{
+		size_t const end = min(params.find_first_of(" \n"), params.size());
+		strview const param = params.substr(0, end);
+		params.remove_prefix(min(end + 1, params.size()));
+		if (param.empty()) continue;
+
+		switch (param[0])
+		{
+		case 'W': format.x = atoi(str(param.substr(1)).c_str()); break;
+		case 'H': format.y = atoi(str(param.substr(1)).c_str()); break;
+		case 'F': format.frame_rate = param.substr(1); break;
+		case 'C':
+			// the 420 variants only differ in chroma siting, the p10, p12 ... ones have 16 bit samples
+			if (param == "C420" or param == "C420jpeg" or param == "C420paldv" or param == "C420mpeg2") format.is_420 = true;
+			else if (param == "C444") format.is_420 = false;
+			else
+			{
+				print_err("[Error] Unsupported y4m colorspace %.*s, use 8 bit 420 or 444.\n", i32(param.size()), param.data());
+				return false;
+			}
+			break;
+		}
+	}
+
+	return format.x > 0 and format.y > 0;
+}
+
+struct FrameReader
+{
+	SequenceKind kind;
+	FILE * file = nullptr;
+	i32 x = 0, y = 0;
+
+	str pattern; // Numbered
+	i32 index = 0;
+	Image pending; // the first frame, it is loaded to find the size
+
+	bool is_bottom_up = true; // Raw
+
+	Y4mFormat y4m; // Y4m
+	unique_array<u8> planes;
+
+	bool has_failed = false; // read() stopped at a broken frame, not at the end
+
+	~FrameReader() { if (file) fclose(file); }
+
+	bool open(const char * path)
+	{
+		kind = get_sequence_kind(path);
+
+		if (kind == SequenceKind::Numbered)
+		{
+			pattern = path;
+			if (pattern.find('%') == str::npos)
+			{
+				print_err("[Error] \"%s\" should be a pattern like frame_%%04d.png\n", path);
+				return false;
+			}
+
+			char frame_path[1024];
+			for (index = 0; index < 2; ++index) // numbering starts from 0 or 1
+			{
+				sprintf_s(frame_path, pattern.c_str(), index);
+				if (get_file_stamp(frame_path).size > 0) break;
+			}
+			if (index == 2)
+			{
+				print_err("[Error] Can't find the first frame of \"%s\".\n", path);
+				return false;
+			}
+
+			pending = load_image(frame_path, true, false);
+			x = pending.x, y = pending.y;
+			return true;
+		}
+
+		file = fopen(path, "rb");
+		if (not file)
+		{
+			print_err("[Error] Can't open \"%s\".\n", path);
+			return false;
+		}
+
+		if (kind == SequenceKind::Raw)
+		{
+			u8 header_bytes[raw_header_size];
+			RawHeader header;
+			bool const is_read = fread(header_bytes, raw_header_size, 1, file) == 1;
+			if (is_read) memcpy(&header, header_bytes, sizeof(header));
+			if (not is_read or memcmp(header.magic, RawHeader{}.magic, 4) != 0 or not is_raw_size_valid(header))
+			{
+				print_err("[Error] \"%s\" is not a raw RGBA stream.\n", path);
+				return false;
+			}
+			x = header.x, y = header.y;
+			is_bottom_up = header.flags & raw_flag_bottom_up;
+			return true;
+		}
+
+		if (not read_y4m_header(file, y4m))
+		{
+			print_err("[Error] \"%s\" is not a supported y4m file.\n", path);
+			return false;
+		}
+		x = y4m.x, y = y4m.y;
+		planes = unique_array<u8>{new u8[y4m.frame_size()]};
+		return true;
+	}
+
+	// false at the end of the sequence or at a broken frame, which also sets has_failed
+	bool read(Image & frame)
+	{
+		size_t const frame_pixels = size_t(x) * y;
+		auto const fail = [this](const char * what)
+		{
+			print_err("[Error] Frame %d %s.\n", index, what);
+			has_failed = true;
+			return false;
+		};
+
+		switch (kind)
+		{
+		case SequenceKind::Numbered:
+		{
+			if (pending.pixels)
+			{
+				pending.blit_into(frame);
+				pending = {};
+				return true;
+			}
+
+			char frame_path[1024];
+			sprintf_s(frame_path, pattern.c_str(), ++index);
+			if (get_file_stamp(frame_path).size == 0) return false;
+
+			Image const img = load_image(frame_path, true, false);
+			if (img.x != x or img.y != y)
+			{
+				print_err("[Error] \"%s\" is %dx%d, the sequence is %dx%d.\n", frame_path, img.x, img.y, x, y);
+				has_failed = true;
+				return false;
+			}
+			img.blit_into(frame);
+			return true;
+		}
+		case SequenceKind::Raw:
+		{
+			// nothing left before a frame is the end, a part of a frame is a truncated file
+			size_t read_pixels = 0;
+			if (is_bottom_up) read_pixels = fread(frame.pixels, sizeof(u8x4), frame_pixels, file);
+			else
+				for (i32 row = y - 1; row >= 0; --row)
+				{
+					size_t const row_pixels = fread(frame.pixels.things + row * x, sizeof(u8x4), x, file);
+					read_pixels += row_pixels;
+					if (row_pixels != size_t(x)) break;
+				}
+
+			if (read_pixels == 0 and feof(file)) return false;
+			++index;
+			if (read_pixels != frame_pixels) return fail(ferror(file) ? "can't be read" : "is truncated");
+			return true;
+		}
+		case SequenceKind::Y4m:
+		{
+			char line[256];
+			if (not fgets(line, sizeof(line), file)) return feof(file) ? false : fail("can't be read");
+			++index;
+			if (strncmp(line, "FRAME", 5) != 0) return fail("has no FRAME header");
+			if (fread(planes, 1, y4m.frame_size(), file) != y4m.frame_size()) return fail(ferror(file) ? "can't be read" : "is truncated");
+			yuv_to_rgba(planes, y4m, frame);
+			return true;
+		}
+		}
+		return false;
+	}
+};
+
+struct FrameWriter
+{
+	SequenceKind kind;
+	FILE * file = nullptr;
+
+	str pattern; // Numbered
+	strview extension;
+	i32 index = 0;
+
+	Y4mFormat y4m; // Y4m
+	unique_array<u8> planes;
+
+	~FrameWriter() { if (file) fclose(file); }
+
+	bool open(const char * path, FrameReader const & reader)
+	{
+		kind = get_sequence_kind(path);
+
+		if (kind == SequenceKind::Numbered)
+		{
+			pattern = path;
+			if (pattern.find('%') == str::npos)
+			{
+				print_err("[Error] \"%s\" should be a pattern like frame_%%04d.png\n", path);
+				return false;
+			}
+			extension = strview(pattern).substr(pattern.rfind('.') + 1);
+			index = reader.kind == SequenceKind::Numbered ? reader.index : 0;
+			return true;
+		}
+
+		file = fopen(path, "wb");
+		if (not file)
+		{
+			print_err("[Error] Can't create \"%s\".\n", path);
+			return false;
+		}
+
+		if (kind == SequenceKind::Raw)
+		{
+			u8 header_bytes[raw_header_size] = {};
+			RawHeader const header{.flags = raw_flag_bottom_up, .x = reader.x, .y = reader.y};
+			memcpy(header_bytes, &header, sizeof(header));
+			return fwrite(header_bytes, raw_header_size, 1, file) == 1;
+		}
+
+		if (reader.kind == SequenceKind::Y4m) y4m = reader.y4m;
+		y4m.x = reader.x, y4m.y = reader.y;
+		planes = unique_array<u8>{new u8[y4m.frame_size()]};
+		fprintf(file, "YUV4MPEG2 W%d H%d F%s Ip A1:1 %s\n", y4m.x, y4m.y, y4m.frame_rate.c_str(), y4m.is_420 ? "C420jpeg" : "C444");
+		return not ferror(file);
+	}
+
+	bool write(Image const & frame)
+	{
+		switch (kind)
+		{
+		case SequenceKind::Numbered:
+		{
+			char frame_path[1024];
+			sprintf_s(frame_path, pattern.c_str(), index++);
+			return write_image(frame, frame_path, extension);
+		}
+		case SequenceKind::Raw:
+			return fwrite(frame.pixels, sizeof(u8x4), size_t(frame.x) * frame.y, file) == size_t(frame.x) * frame.y;
+		case SequenceKind::Y4m:
+			rgba_to_yuv(frame, y4m, planes);
+			fputs("FRAME\n", file);
+			return fwrite(planes, 1, y4m.frame_size(), file) == y4m.frame_size();
+		}
+		return false;
+	}
+};
+
+// a blocking FIFO of ring slot indices, it never holds more than sequence_ring_size of them
+struct SlotQueue
+{
+	static constexpr i32 end = -1; // pushed once after the last frame
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<i32> slots;
+
+	void push(i32 slot)
+	{
+		{
+			std::lock_guard lock(mutex);
+			slots.push_back(slot);
+		}
+		condition.notify_one();
+	}
 
-public:
-	~FileWatcher()
+	i32 pop()
 	{
-		if (file_handle != INVALID_HANDLE_VALUE) CancelIo(file_handle), CloseHandle(file_handle);
-		if (overlapped.hEvent != INVALID_HANDLE_VALUE) CloseHandle(overlapped.hEvent);
+		std::unique_lock lock(mutex);
+		condition.wait(lock, [this]{ return not slots.empty(); });
+		i32 const slot = slots.front();
+		slots.pop_front();
+		return slot;
 	}
+};
 
-	void watch(str const & file_abs_path)
+int run_sequence(const char * input_path, const char * output_path, const char * target_path)
+{
+	str const target_abs_path = get_full_path(target_path);
+	std::vector<PipelineStage> stages;
+	if (not build_target(target_abs_path.c_str(), true, stages)) return EXIT_FAILURE;
+
+	FrameReader reader;
+	if (not reader.open(input_path)) return EXIT_FAILURE;
+	FrameWriter writer;
+	if (not writer.open(output_path, reader)) return EXIT_FAILURE;
+	printf("Sequence: %s -> %s, resolution: %dx%d\n", input_path, output_path, reader.x, reader.y);
+
+	std::vector<Process> processes;
+	for (PipelineStage const & stage : stages)
+		processes.push_back(load_process(stage.dll_name.c_str(), stage.args.c_str()));
+
+	struct Slot { Image input, output; };
+	std::vector<Slot> ring;
+	ring.push_back({Image(reader.x, reader.y, nullptr), Image(reader.x, reader.y, nullptr)});
+	SlotQueue free_slots, decoded, processed;
+
+	is_quiet = true;
+	is_dirty_cache_enabled = true;
+	u64 const begin = GetTickCount64();
+
+	i32 frame_count = 0;
+	bool const has_frames = reader.read(ring[0].input);
+	if (has_frames)
 	{
-		wstr wfile_abs_path = str_to_wstr(file_abs_path);
-		size_t dir_end_idx = wfile_abs_path.find_last_of(L"\\/");
-		if (dir_end_idx == std::string::npos) exit_err("[Error] Invalid path");
-
-		wstr dir = wfile_abs_path.substr(0, dir_end_idx);
-		file_name = wfile_abs_path.substr(dir_end_idx + 1);
-
-		if (file_handle != INVALID_HANDLE_VALUE) CancelIo(file_handle), CloseHandle(file_handle);
-		file_handle = CreateFileW(
-			dir.c_str(),
-			FILE_LIST_DIRECTORY,
-			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-			0,
-			OPEN_EXISTING,
-			FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
-			0
+		AllocStats const alloc = run_pipeline(processes, ring[0].input, ring[0].output);
+		processed.push(0);
+		frame_count = 1;
+
+		u64 const slot_bytes = 2 * u64(reader.x) * reader.y * sizeof(u8x4);
+		u64 const used = u64(max<i64>(0, alloc.peak_bytes)) + get_dirty_cache_bytes();
+		u64 const available = sequence_memory_budget - min(sequence_memory_budget, used);
+		i32 const ring_size = i32(clamp<u64>(available / slot_bytes, 2, sequence_ring_size));
+		printf(
+			"Ring: %d frames, process allocates %.2f MB per frame, dirty bands keep %.2f MB\n",
+			ring_size, f64(alloc.peak_bytes) / (1 << 20), f64(get_dirty_cache_bytes()) / (1 << 20)
 		);
-		if (file_handle == INVALID_HANDLE_VALUE) exit_err("[Error] CreateFileA failed");
-
-		if (overlapped.hEvent != INVALID_HANDLE_VALUE) CloseHandle(overlapped.hEvent);
-		overlapped.hEvent = CreateEventA(0, false, false, nullptr);
-		if (overlapped.hEvent == INVALID_HANDLE_VALUE) exit_err("[Error] CreateEventA failed");
 
-		if (not ReadDirectoryChangesW(
-			file_handle,
-			buffer, buffer_size,
-			false,
-			FILE_NOTIFY_CHANGE_LAST_WRITE,
-			nullptr,
-			&overlapped,
-			nullptr
-		)) exit_err("[Error] ReadDirectoryChangesW failed");
+		// the threads are not running yet, ring doesn't move under them
+		for (i32 i = 1; i < ring_size; ++i)
+		{
+			ring.push_back({Image(reader.x, reader.y, nullptr), Image(reader.x, reader.y, nullptr)});
+			free_slots.push(i);
+		}
 	}
+	else decoded.push(SlotQueue::end);
 
-	bool is_notified()
+	std::thread decoder;
+	if (has_frames) decoder = std::thread([&]
 	{
-		if (file_handle == INVALID_HANDLE_VALUE) return false;
-
-		bool is_file_changed = false;
-
-		// there may be many notifications, process all
-		while (true)
+		for (;;)
 		{
-			DWORD bytes_written;
-			if (not GetOverlappedResult(file_handle, &overlapped, &bytes_written, false))
-			{
-				if (GetLastError() != ERROR_IO_INCOMPLETE) exit_err("[Error] GetOverlappedResult failed\n");
-				break;
-			}
-
-			std::byte * ptr = buffer.things;
-			FILE_NOTIFY_INFORMATION * notification = reinterpret_cast<FILE_NOTIFY_INFORMATION *>(ptr);
-			while (notification->Action != 0)
-			{
-				wstrview name(notification->FileName, notification->FileNameLength / sizeof(wchar_t));
-				if (name == file_name) is_file_changed = true;
-
-				// check for any other notifications
-				if (notification->NextEntryOffset == 0) break;
-
-				ptr += notification->NextEntryOffset;
-				notification = reinterpret_cast<FILE_NOTIFY_INFORMATION *>(ptr);
-			}
+			i32 const slot = free_slots.pop();
+			if (not reader.read(ring[slot].input)) break;
+			decoded.push(slot);
+		}
+		decoded.push(SlotQueue::end);
+	});
 
-			if (not ReadDirectoryChangesW(
-				file_handle,
-				buffer, buffer_size,
-				false,
-				FILE_NOTIFY_CHANGE_LAST_WRITE,
-				nullptr,
-				&overlapped,
-				nullptr
-			)) exit_err("[Error] ReadDirectoryChangesW failed");
+	i32 failed_count = 0;
+	std::thread encoder([&]
+	{
+		for (i32 slot; (slot = processed.pop()) != SlotQueue::end;)
+		{
+			if (not writer.write(ring[slot].output)) ++failed_count;
+			free_slots.push(slot);
 		}
+	});
 
-		return is_file_changed;
+	for (i32 slot; (slot = decoded.pop()) != SlotQueue::end; ++frame_count)
+	{
+		run_pipeline(processes, ring[slot].input, ring[slot].output);
+		processed.push(slot);
 	}
-};
+	processed.push(SlotQueue::end);
 
-#pragma endregion
+	if (decoder.joinable()) decoder.join();
+	encoder.join();
+	is_quiet = false;
 
-#pragma region Graphics
-#define STBI_ONLY_JPEG
-#define STBI_ONLY_PNG
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb/image.h>
+	u64 const elapsed_ms = max<u64>(1, GetTickCount64() - begin);
+	printf("Processed %d frames in %llu ms (%.1f fps)\n", frame_count, elapsed_ms, 1000. * frame_count / elapsed_ms);
+	if (failed_count > 0) print_err("[Error] Failed to write %d frames.\n", failed_count);
+	if (reader.has_failed) print_err("[Error] The input has a broken frame, only the frames before it are written.\n");
 
-Image load_image(const char * path, bool flip_vertically = true)
-{
-	FILE * image_file = fopen(path, "rb");
-	if (not image_file) exit_err("Can't open image file");
+	for (Process & process : processes)
+		free_process(process);
 
-	stbi_set_flip_vertically_on_load(flip_vertically);
+	return failed_count == 0 and not reader.has_failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-	int x, y, c;
-	stbi_uc * rgba_pixels = stbi_load_from_file(image_file, &x, &y, &c, 4);
-	if (not rgba_pixels) exit_err("Can't load image: %s", stbi_failure_reason());
-	fclose(image_file);
+#pragma endregion
 
-	return {x, y, (u8x4 *)(rgba_pixels)};
-}
+#pragma region Tuning
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb/image_write.h>
+/* main --tune <proc_path> <image_paths...>
+ Builds the proc instrumented (pgi) with this CPU's best /arch, runs it over the images to collect a
+ profile, rebuilds it with the profile (pgo), then reports its speed against a rel build without allocation
+ counting (bench).
+ An up to date tuned build is only timed, not rebuilt.
+*/
 
-void save_image(Image const & img, strview path, bool flip_vertically = true)
-{
-	stbi_flip_vertically_on_write(flip_vertically);
+constexpr i32 tune_training_runs = 3;
+constexpr i32 tune_timing_runs = 5;
 
-	str new_path;
-	new_path.reserve(path.size() + 32);
-	size_t dot_idx = path.rfind('.');
-	new_path += path.substr(0, dot_idx);
-	new_path += "_processed";
-	new_path += path.substr(dot_idx);
+// sum over the images of the fastest run (init + process), in ms
+f64 time_process(const char * dll_name, std::vector<Image> const & images, i32 run_count)
+{
+	Process process = load_process(dll_name, "");
 
-	if (path.ends_with("png"))	stbi_write_png(new_path.c_str(), img.x, img.y, 4, img.pixels, img.y * sizeof(u8x4));
-	else						stbi_write_jpg(new_path.c_str(), img.x, img.y, 4, img.pixels, 100);
+	f64 total_ms = 0;
+	for (Image const & image : images)
+	{
+		Image proc_img(image.x, image.y, nullptr);
+		f64 best_ms = 1e30;
+		for (i32 run = 0; run < run_count; ++run)
+		{
+			auto const begin = std::chrono::steady_clock::now();
+			image.blit_into(proc_img);
+			process.init(image);
+			process.process(proc_img, 0);
+			best_ms = min(best_ms, std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - begin).count());
+		}
+		total_ms += best_ms;
+	}
 
-	printf("Saved iamge to %s\n", new_path.c_str());
+	free_process(process); // an instrumented dll writes its profile (.pgc) when it is unloaded
+	return total_ms;
 }
 
-#define GLFW_INCLUDE_NONE
-#include <GLFW/glfw3.h>
-#include <glad/gl.h>
-
-struct TextureDesc
+int run_tune(const char * proc_path, i32 image_count, const char * const * image_paths)
 {
-	int x, y;
-	u8x4 * pixels = nullptr;
+	str const proc_abs_path = get_full_path(proc_path);
+	CpuInfo const & cpu = get_cpu_info();
+	printf("CPU: %s, arch: %s\n", cpu.brand.c_str(), cpu.arch[0] ? cpu.arch : "default");
 
-	GLenum min_filter = GL_LINEAR;
-	GLenum mag_filter = GL_LINEAR;
+	std::vector<Image> images;
+	for (i32 i = 0; i < image_count; ++i)
+		images.push_back(load_image(image_paths[i]));
 
-	GLenum wrap_s = GL_CLAMP_TO_EDGE;
-	GLenum wrap_t = GL_CLAMP_TO_EDGE;
-};
-GLuint create_texture(TextureDesc const & desc)
-{
-	GLuint id;
-	glGenTextures(1, &id);
+	CreateDirectoryA(dll_dir, nullptr);
+	CreateDirectoryA(tuned_dir, nullptr);
+	str const tuned_dll = tuned_dll_name(proc_abs_path.c_str());
+	str const baseline_dll = tuned_dll + "_bench";
 
-	glBindTexture(GL_TEXTURE_2D, id);
-	glTexImage2D(GL_TEXTURE_2D,0, GL_RGBA8, desc.x, desc.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, desc.pixels);
+	// like the tuned build the baseline doesn't count allocations, only the profile and /arch differ
+	if (not build_process(proc_abs_path.c_str(), baseline_dll.c_str(), true, "bench")) return EXIT_FAILURE;
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, desc.min_filter);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, desc.mag_filter);
+	if (is_tuned_dll_fresh(proc_abs_path.c_str(), tuned_dll.c_str()))
+		printf("Tuned build %s is up to date\n", tuned_dll.c_str());
+	else
+	{
+		// profiles of an older build would be merged in too
+		for (i32 i = 1;; ++i)
+		{
+			char pgc_path[1024];
+			sprintf_s(pgc_path, "%s%s!%d.pgc", dll_dir, tuned_dll.c_str(), i);
+			if (remove(pgc_path) != 0) break;
+		}
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		// build_dll names the instrumented build <tuned_dll>_pgi, the tuned dll is only written by the pgo link
+		if (not build_process(proc_abs_path.c_str(), tuned_dll.c_str(), false, "pgi", cpu.arch)) return EXIT_FAILURE;
+		{
+			TimeScope("Training runs");
+			time_process((tuned_dll + "_pgi").c_str(), images, tune_training_runs);
+		}
+		if (not build_process(proc_abs_path.c_str(), tuned_dll.c_str(), false, "pgo", cpu.arch))
+			return remove(dll_rel_path(tuned_dll.c_str()).c_str()), EXIT_FAILURE;
+	}
 
-	glGenerateMipmap(GL_TEXTURE_2D);
+	f64 const baseline_ms = time_process(baseline_dll.c_str(), images, tune_timing_runs);
+	f64 const tuned_ms = time_process(tuned_dll.c_str(), images, tune_timing_runs);
+	printf("Baseline: %.2f ms, tuned: %.2f ms, speedup: %.2fx\n", baseline_ms, tuned_ms, baseline_ms / tuned_ms);
 
-	return id;
+	return EXIT_SUCCESS;
 }
 
-void upload_texture(GLuint tex, Image const & img)
-{
-	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, img.x, img.y, GL_RGBA, GL_UNSIGNED_BYTE, img.pixels);
-}
+#pragma endregion
 
-void download_texture(GLuint tex, Image & img)
+#pragma region Regression
+
+/* main --regress <manifest_path> [--bless]
+ Runs every case of the manifest in an isolated worker and compares its result to a golden image.
+ Each line is `<proc_path> <image_path> [exact | psnr=<dB>] [reference] [time_x=<budget> | time_ms=<budget>] [mem_mb=<budget>] [timeout_ms=<kill after>] [incremental]`,
+ paths are relative to the manifest, # starts a comment. Goldens are golden\<proc>_<image>.qoi next
+ to the manifest, --bless (re)writes them from the current results.
+ A case fails if its result differs (exact is the default) or is below the PSNR, or it is over a budget.
+ Time is init + process of the worker, memory is the worker's peak private bytes. The processes' own
+ allocations (peak, see Allocation stats) are reported next to them.
+ time_x is a multiple of the time of the reference case above it, so the same manifest holds on a faster or slower
+ machine. time_ms is absolute and only holds on the machine it was tuned on.
+ incremental also runs the target in this process with dirty bands (see Dirty bands): once, again after a
+ few rows of the input are edited, then cold. The second run has to reuse rows and equal the cold one.
+*/
+
+struct RegressCase
 {
-	glBindTexture(GL_TEXTURE_2D, tex);
-	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, img.pixels);
-}
+	str proc_abs_path, image_path, golden_path;
+	f64 min_psnr = 0; // 0 means exact
+	f64 time_budget_ms = 0; // 0 means no budget
+	f64 time_budget_x = 0; // times the reference case's time, 0 means no budget
+	bool is_reference = false;
+	f64 mem_budget_mb = 0;
+	DWORD timeout_ms = 0; // 0 means get_worker_timeout_ms
+	bool is_incremental_checked = false;
+};
 
-void gl_debug_callback(
-	GLenum source, GLenum type, GLuint id, GLenum severity,
-	GLsizei length, const GLchar * message, const void * userParam
-)
+bool load_regress_manifest(const char * manifest_path, std::vector<RegressCase> & cases)
 {
-	const char * source_str;
-	switch (source)
-	{
-	case GL_DEBUG_SOURCE_API:				source_str = "API";break;
-	case GL_DEBUG_SOURCE_WINDOW_SYSTEM:		source_str = "Window System";break;
-	case GL_DEBUG_SOURCE_SHADER_COMPILER:	source_str = "Shader Compiler";break;
-	case GL_DEBUG_SOURCE_THIRD_PARTY:		source_str = "Third Party";break;
-	case GL_DEBUG_SOURCE_APPLICATION:		source_str = "Application";break;
-	case GL_DEBUG_SOURCE_OTHER:				source_str = "Other";break;
-	default: break;
-	}
-	const char * type_str;
-	switch (type)
-	{
-	case GL_DEBUG_TYPE_ERROR:				type_str = "Error";break;
-	case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR:	type_str = "Deprecated Behaviour";break;
-	case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:	type_str = "Undefined Behaviour";break;
-	case GL_DEBUG_TYPE_PORTABILITY:			type_str = "Portability";break;
-	case GL_DEBUG_TYPE_PERFORMANCE:			type_str = "Performance";break;
-	case GL_DEBUG_TYPE_MARKER:				type_str = "Marker";break;
-	case GL_DEBUG_TYPE_PUSH_GROUP:			type_str = "Push Group";break;
-	case GL_DEBUG_TYPE_POP_GROUP:			type_str = "Pop Group";break;
-	case GL_DEBUG_TYPE_OTHER:				type_str = "Other";break;
-	default: break;
-	}
-	const char * severity_str;
-	switch (severity)
-	{
-	case GL_DEBUG_SEVERITY_HIGH: 			severity_str = " !!!"; break;
-	case GL_DEBUG_SEVERITY_MEDIUM: 			severity_str = " !!"; break;
-	case GL_DEBUG_SEVERITY_LOW: 			severity_str = " !"; break;
-	case GL_DEBUG_SEVERITY_NOTIFICATION:	severity_str = ""; break;
-	default: break;
-	}
+	FILE * file = fopen(manifest_path, "rb");
+	if (file == nullptr) return print_err("[Error] Can't open the manifest \"%s\"\n", manifest_path), false;
 
-	print_err("GL[%s %s%s]", source_str, type_str, severity_str);
-	print_err(" %i: %s%c", id, message, (message[length - 2] != '\n' ? '\n' : '\0'));
-}
+	str const manifest_abs_path = get_full_path(manifest_path);
+	str const manifest_dir = manifest_abs_path.substr(0, manifest_abs_path.find_last_of("\\/") + 1);
 
+	bool has_reference = false;
+	char line[1024];
+	for (i32 line_no = 1; fgets(line, sizeof(line), file); ++line_no)
+	{
+		std::vector<strview> tokens;
+		for (char * token = strtok(line, " \t\r\n"); token and token[0] != '#'; token = strtok(nullptr, " \t\r\n"))
+			tokens.push_back(token);
+		if (tokens.empty()) continue;
+		if (tokens.size() < 2)
+		{
+			print_err("[Error] %s:%d expected <proc_path> <image_path>\n", manifest_path, line_no);
+			return fclose(file), false;
+		}
 
-GLuint blit_program;
+		RegressCase c;
+		c.proc_abs_path = get_full_path(resolve_path(manifest_dir, tokens[0]).c_str());
+		c.image_path = get_full_path(resolve_path(manifest_dir, tokens[1]).c_str());
 
-void init_blit_program()
-{
-	blit_program = glCreateProgram();
-	
-	GLuint vert = glCreateShader(GL_VERTEX_SHADER);
-	const char * vert_src = R"VERT(#version 330
-out vec2 uv;
+		auto const stem = [](strview path)
+		{
+			path = path.substr(path.find_last_of("\\/") + 1);
+			return str(path.substr(0, path.find_last_of('.')));
+		};
+		c.golden_path = manifest_dir + "golden\\" + stem(c.proc_abs_path) + "_" + stem(c.image_path) + ".qoi";
 
-void main()
-{
-//  2
-//  |`.
-//  |  `.
-//  |----`.
-//  |    | `.
-//  '----'----
-//  0         1
-//
-//  gl_VertexID = 0  =>  gl_Position = (-1, -1, 1, 1) | uv = (0, 0)
-//  gl_VertexID = 1  =>  gl_Position = (+3, -1, 1, 1) | uv = (2, 0)
-//  gl_VertexID = 2  =>  gl_Position = (-1, +3, 1, 1) | uv = (0, 2)
+		for (size_t i = 2; i < tokens.size(); ++i)
+		{
+			strview const token = tokens[i];
+			size_t const eq_idx = token.find('=');
+			strview const key = token.substr(0, eq_idx);
+			f64 const value = eq_idx == strview::npos ? 0 : atof(str(token.substr(eq_idx + 1)).c_str());
+
+			if (key == "exact")			c.min_psnr = 0;
+			else if (key == "psnr")		c.min_psnr = value;
+			else if (key == "reference")	c.is_reference = has_reference = true;
+			else if (key == "time_x")	c.time_budget_x = value;
+			else if (key == "time_ms")	c.time_budget_ms = value;
+			else if (key == "mem_mb")	c.mem_budget_mb = value;
+			else if (key == "timeout_ms")	c.timeout_ms = DWORD(value);
+			else if (key == "incremental")	c.is_incremental_checked = true;
+			else
+			{
+				print_err("[Error] %s:%d unknown option \"%.*s\"\n", manifest_path, line_no, i32(token.size()), token.data());
+				return fclose(file), false;
+			}
+		}
 
-    gl_Position = vec4(
-        gl_VertexID == 1 ? 3 : -1,
-        gl_VertexID == 2 ? 3 : -1,
-        1,
-        1
-    );
+		if (c.time_budget_x > 0 and not has_reference)
+		{
+			print_err("[Error] %s:%d time_x needs a reference case above it\n", manifest_path, line_no);
+			return fclose(file), false;
+		}
 
-    uv = vec2(
-        gl_VertexID == 1 ? 2 : 0,
-        gl_VertexID == 2 ? 2 : 0
-    );
+		cases.push_back(std::move(c));
+	}
+
+	fclose(file);
+	return true;
 }
-	)VERT";
-	glShaderSource(vert, 1, &vert_src, 0);
-	glCompileShader(vert);
-	
-	GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
-	const char * frag_src = R"FRAG(#version 330
-in vec2 uv;
 
-uniform sampler2D tex;
+// over all channels, infinite if the images are identical
+f64 image_psnr(Image const & a, Image const & b)
+{
+	u8 const * pa = (u8 const *)a.pixels.things;
+	u8 const * pb = (u8 const *)b.pixels.things;
+	i64 const byte_count = i64(a.x) * a.y * 4;
 
-out vec4 color;
+	u64 squared_error = 0;
+	#pragma omp parallel for reduction(+: squared_error)
+	for (i64 i = 0; i < byte_count; ++i)
+	{
+		i32 const d = i32(pa[i]) - i32(pb[i]);
+		squared_error += u64(d * d);
+	}
 
-void main()
-{
-	color = texture(tex, uv);
+	if (squared_error == 0) return INFINITY;
+	f64 const mse = f64(squared_error) / f64(byte_count);
+	return 10 * log10(255.0 * 255.0 / mse);
 }
-	)FRAG";
-	glShaderSource(frag, 1, &frag_src, 0);
-	glCompileShader(frag);
-
-	glAttachShader(blit_program, vert);
-	glAttachShader(blit_program, frag);
-	glLinkProgram(blit_program);
 
-	glUseProgram(blit_program);
-	glUniform1i(glGetUniformLocation(blit_program, "tex"), 0);
+// nullptr if the incremental run equals the cold one
+const char * check_incremental(const char * target_abs_path, Image const & input)
+{
+	std::vector<PipelineStage> stages;
+	if (not build_target(target_abs_path, true, stages)) return "the build failed";
+
+	std::vector<Process> processes;
+	for (PipelineStage const & stage : stages)
+		processes.push_back(load_process(stage.dll_name.c_str(), stage.args.c_str()));
+
+	bool const was_enabled = is_dirty_cache_enabled;
+	is_dirty_cache_enabled = true;
+	dirty_caches.clear();
+
+	Image edited(input.x, input.y, nullptr), incremental(input.x, input.y, nullptr), cold(input.x, input.y, nullptr);
+	input.blit_into(edited);
+	run_pipeline(processes, edited, incremental);
+
+	// a few rows in the middle of the image, not aligned to the bands
+	i32 const y_begin = input.y / 2 + 3;
+	i32 const y_end = min(input.y, y_begin + 5);
+	for (i32 y = y_begin; y < y_end; ++y)
+		for (i32 x = input.x / 3; x < 2 * input.x / 3; ++x)
+			for (i32 c = 0; c < 3; ++c)
+				edited.pixels[y * input.x + x][c] ^= 0x5a;
+
+	i64 const reused_rows = dirty_reused_rows;
+	run_pipeline(processes, edited, incremental);
+	bool const is_reused = dirty_reused_rows > reused_rows;
+
+	dirty_caches.clear();
+	run_pipeline(processes, edited, cold);
+	dirty_caches.clear();
+	is_dirty_cache_enabled = was_enabled;
+
+	for (Process & process : processes)
+		free_process(process);
+
+	if (not is_reused) return "no rows were reused, does it declare a halo?";
+	if (memcmp(incremental.pixels, cold.pixels, size_t(input.x) * input.y * sizeof(u8x4)) != 0)
+		return "the incremental run differs from a cold run";
+	return nullptr;
 }
 
-void blit_texture(GLuint tex)
+int run_regress(const char * manifest_path, bool is_bless)
 {
-	glUseProgram(blit_program);
+	std::vector<RegressCase> cases;
+	if (not load_regress_manifest(manifest_path, cases)) return EXIT_FAILURE;
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, tex);
+	CreateDirectoryA(dll_dir, nullptr);
+	if (is_bless and not cases.empty())
+	{
+		str const golden_dir = cases[0].golden_path.substr(0, cases[0].golden_path.find_last_of('\\'));
+		CreateDirectoryA(golden_dir.c_str(), nullptr);
+	}
 
-	glDrawArrays(GL_TRIANGLES, 0, 3);
+	is_quiet = true;
+	i32 failed_count = 0;
+	f64 reference_ms = 0;
+	for (RegressCase const & c : cases)
+	{
+		strview const name = strview(c.golden_path).substr(c.golden_path.find_last_of('\\') + 1);
+		printf("[Regress] %.*s\n", i32(name.size() - 4), name.data());
+
+		Image const input = load_image(c.image_path.c_str());
+		SharedImages shared;
+		WorkerStats stats;
+		char failure[256] = "";
+		char result[64] = "";
+
+		if (not shared.create(input))
+			sprintf_s(failure, "can't share the images");
+		else if (not build_and_apply_isolated(c.proc_abs_path.c_str(), true, shared, &stats, c.timeout_ms))
+			sprintf_s(failure, "the run failed");
+		else if (is_bless)
+		{
+			if (save_qoi(shared.proc, c.golden_path.c_str(), true)) sprintf_s(result, "blessed");
+			else sprintf_s(failure, "can't write the golden");
+		}
+		else if (get_file_stamp(c.golden_path.c_str()).size == 0)
+			sprintf_s(failure, "no golden, run with --bless");
+		else
+		{
+			Image const golden = load_qoi(c.golden_path.c_str(), true);
+			if (golden.x != shared.proc.x or golden.y != shared.proc.y)
+				sprintf_s(failure, "size %dx%d, golden is %dx%d", shared.proc.x, shared.proc.y, golden.x, golden.y);
+			else
+			{
+				f64 const psnr = image_psnr(shared.proc, golden);
+				if (isinf(psnr)) sprintf_s(result, "identical");
+				else sprintf_s(result, "psnr %.2f dB", psnr);
+
+				if (c.min_psnr == 0 and not isinf(psnr)) sprintf_s(failure, "differs from the golden");
+				else if (psnr < c.min_psnr) sprintf_s(failure, "psnr below %.2f dB", c.min_psnr);
+			}
+		}
+
+		f64 const mem_mb = f64(stats.peak_bytes) / (1 << 20);
+		f64 const alloc_mb = f64(stats.alloc.peak_bytes) / (1 << 20);
+		if (c.is_reference and stats.run_ms > 0) reference_ms = stats.run_ms;
+
+		f64 const time_budget_ms = c.time_budget_x > 0 ? c.time_budget_x * reference_ms : c.time_budget_ms;
+		if (failure[0] == 0 and c.time_budget_x > 0 and reference_ms == 0)
+			sprintf_s(failure, "the reference case didn't run, no time budget");
+		else if (failure[0] == 0 and time_budget_ms > 0 and stats.run_ms > time_budget_ms)
+			sprintf_s(failure, "over the time budget (%.0f ms)", time_budget_ms);
+		if (failure[0] == 0 and c.mem_budget_mb > 0 and mem_mb > c.mem_budget_mb)
+			sprintf_s(failure, "over the memory budget (%.0f MB)", c.mem_budget_mb);
+		if (failure[0] == 0 and c.is_incremental_checked)
+			if (const char * error = check_incremental(c.proc_abs_path.c_str(), input))
+				sprintf_s(failure, "%s", error);
+
+		if (failure[0] == 0)
+			printf("  ok   %-16s %8.2f ms %8.1f MB (allocated %.1f MB)\n", result, stats.run_ms, mem_mb, alloc_mb);
+		else
+		{
+			printf("  FAIL %-16s %8.2f ms %8.1f MB (allocated %.1f MB) | %s\n", result, stats.run_ms, mem_mb, alloc_mb, failure);
+			failed_count += 1;
+		}
+	}
+	is_quiet = false;
+
+	printf("%zu cases, %d failed\n", cases.size(), failed_count);
+	return failed_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 #pragma endregion
@@ -441,11 +2326,14 @@ struct {
 	bool gl_debug = true;
 	int target_fps = 120;
 	int tex_count = 1/*Original*/ + 3/*Processed*/;
+	const char * save_extensions[5] = {"", "png", "jpg", "qoi", "rgba"}; // "" keeps the original's format
 } constexpr Config;
 
 struct {
 	int active_tex_idx = 0;
 	str target_abs_path = {};
+	int save_extension_idx = 0;
+	bool is_isolated = false;
 } State;
 
 struct {
@@ -453,6 +2341,8 @@ struct {
 	bool apply_process 			= false;
 	bool change_target_abs_path = false;
 	bool save_image 			= false;
+	bool change_save_format 	= false;
+	bool toggle_isolation 		= false;
 } Actions;
 
 void clear_actions()
@@ -467,6 +2357,11 @@ void key_callback(GLFWwindow * window, int key, int scancode, int action, int mo
 	if (action == GLFW_PRESS and key >= GLFW_KEY_1 and key < GLFW_KEY_1 + Config.tex_count)
 		Actions.switch_texture = true, State.active_tex_idx = key - GLFW_KEY_1;
 	if (action == GLFW_PRESS and key == GLFW_KEY_S) Actions.save_image = true;
+	if (action == GLFW_PRESS and key == GLFW_KEY_F)
+		Actions.change_save_format = true,
+		State.save_extension_idx = (State.save_extension_idx + 1) % std::size(Config.save_extensions);
+	if (action == GLFW_PRESS and key == GLFW_KEY_I)
+		Actions.toggle_isolation = true, State.is_isolated = not State.is_isolated;
 }
 
 void drop_callback(GLFWwindow* window, int path_count, const char* paths[])
@@ -480,8 +2375,10 @@ void update_window_title(GLFWwindow * window)
 {
 	char title[128];
 	sprintf_s(
-		title, "Image Processor > Image %i (%s)",
-		State.active_tex_idx + 1, State.active_tex_idx == 0 ? "Original" : "Processed"
+		title, "Image Processor > Image %i (%s) > Save as %s%s",
+		State.active_tex_idx + 1, State.active_tex_idx == 0 ? "Original" : "Processed",
+		State.save_extension_idx == 0 ? "original" : Config.save_extensions[State.save_extension_idx],
+		State.is_isolated ? " > Isolated" : ""
 	);
 	glfwSetWindowTitle(window, title);
 }
@@ -491,6 +2388,27 @@ void update_window_title(GLFWwindow * window)
 int main(int argc, const char * argv[])
 {
 	/// Init
+	if (argc > 1 and strcmp(argv[1], "--sequence") == 0)
+	{
+		if (argc < 5) exit_err("Usage: --sequence <input> <output> <proc_path>");
+		return run_sequence(argv[2], argv[3], argv[4]);
+	}
+	if (argc > 1 and strcmp(argv[1], "--tune") == 0)
+	{
+		if (argc < 4) exit_err("Usage: --tune <proc_path> <image_paths...>");
+		return run_tune(argv[2], argc - 3, argv + 3);
+	}
+	if (argc > 1 and strcmp(argv[1], "--regress") == 0)
+	{
+		if (argc < 3) exit_err("Usage: --regress <manifest_path> [--bless]");
+		return run_regress(argv[2], argc > 3 and strcmp(argv[3], "--bless") == 0);
+	}
+	if (argc > 1 and strcmp(argv[1], "--worker") == 0)
+	{
+		if (argc < 4) exit_err("Usage: --worker <mapping_name> <target_abs_path>");
+		return run_worker(argv[2], argv[3]);
+	}
+
 	if (argc < 2) exit_err("Supply image path as the first argument");
 	const char * const orig_img_path = argv[1];
 	printf("Image: %s\n", orig_img_path);
@@ -546,6 +2464,24 @@ int main(int argc, const char * argv[])
 	}
 
 	FileWatcher file_watcher;
+	is_dirty_cache_enabled = true;
+
+	SharedImages shared_images; // created the first time isolation is turned on
+
+	auto const apply_target = [&](bool check_write_times)
+	{
+		bool const is_applied = State.is_isolated
+			? build_and_apply_isolated(State.target_abs_path.c_str(), check_write_times, shared_images)
+			: build_and_apply(State.target_abs_path.c_str(), check_write_times, orig_img, proc_img);
+
+		// a build may have added or removed includes
+		file_watcher.watch(get_target_dependencies(State.target_abs_path.c_str()));
+		if (not is_applied) return;
+
+		GLuint const & proc_tex = texs[State.active_tex_idx];
+		upload_texture(proc_tex, State.is_isolated ? shared_images.proc : proc_img);
+		blit_texture(proc_tex);
+	};
 
 
 	/// Run
@@ -558,7 +2494,14 @@ int main(int argc, const char * argv[])
 		glfwPollEvents();
 		if (file_watcher.is_notified()) Actions.apply_process = true;
 
-		if (Actions.switch_texture) 
+		if (Actions.toggle_isolation and State.is_isolated and not shared_images.view)
+			if (not shared_images.create(orig_img))
+			{
+				print_err("[Error] Can't create the shared images, error %lu.\n", GetLastError());
+				State.is_isolated = false;
+			}
+
+		if (Actions.switch_texture or Actions.change_save_format or Actions.toggle_isolation)
 		{
 			blit_texture(texs[State.active_tex_idx]);
 			update_window_title(window);
@@ -571,15 +2514,7 @@ int main(int argc, const char * argv[])
 			else if (State.active_tex_idx == 0)
 				print_err("[Error] Select a Processed image to store the result.\n");
 			else
-			{
-				if (build_process(State.target_abs_path.c_str(), true))
-				{
-					GLuint const & proc_tex = texs[State.active_tex_idx];
-					apply_process(orig_img, proc_img);
-					upload_texture(proc_tex, proc_img);
-					blit_texture(proc_tex);
-				}
-			}
+				apply_target(true);
 		}
 
 		if (Actions.change_target_abs_path)
@@ -587,24 +2522,14 @@ int main(int argc, const char * argv[])
 			if (State.active_tex_idx == 0)
 				print_err("[Error] Select a Processed image to store the result.\n");
 			else
-			{
-				if (build_process(State.target_abs_path.c_str(), false))
-				{
-					GLuint const & proc_tex = texs[State.active_tex_idx];
-					apply_process(orig_img, proc_img);
-					upload_texture(proc_tex, proc_img);
-					blit_texture(proc_tex);
-				}
-
-				file_watcher.watch(State.target_abs_path);
-			}
+				apply_target(false);
 		}
 
 		if (Actions.save_image)
 		{
-			download_texture(texs[State.active_tex_idx], proc_img);
-			save_image(proc_img, orig_img_path);
-			printf("Saved image\n");
+			Image snapshot(orig_img.x, orig_img.y, nullptr);
+			download_texture(texs[State.active_tex_idx], snapshot);
+			image_saver.save(std::move(snapshot), orig_img_path, Config.save_extensions[State.save_extension_idx]);
 		}
 
 		glFinish();
@@ -616,6 +2541,7 @@ int main(int argc, const char * argv[])
 
 
 	/// Clean
+	image_saver.wait();
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <cmath>
+#include <type_traits>
+#include <emmintrin.h>
+
+/* Pixel expressions
+ Builds per pixel math at compile time, apply() turns it into a single fused loop over the image.
+ Channels evaluate to f32 in [0, 255], results are clamped to [0, 255] when stored.
+
+    apply(image, 255 - px.r, 255 - px.g, 255 - px.b, px.a);
+
+    auto const luma = px.r * 0.2126f + px.g * 0.7152f + px.b * 0.0722f;
+    auto const bw = select(luma > 127, 255, 0);
+    apply(image, bw, bw, bw, px.a);
+
+    u8 gamma[256]; // filled once in init
+    apply(image, lut(gamma, px.r), lut(gamma, px.g), lut(gamma, px.b), px.a);
+
+ Pixels are deinterleaved into planes of pixel_expr_block_size, so every channel expression is a
+ plain loop over contiguous f32s which the compiler can vectorize. Results are rounded to nearest.
+*/
+
+constexpr i32 pixel_expr_block_size = 64;
+
+struct PixelBlock
+{
+    f32 planes[4][pixel_expr_block_size];
+};
+
+struct PixelExprBase {};
+template<typename T> concept PixelExpr = std::is_base_of_v<PixelExprBase, T>;
+template<typename T> concept PixelOperand = PixelExpr<T> or arithmetic<T>;
+
+template<i32 C>
+struct PixelChannel : PixelExprBase
+{
+    f32 eval(PixelBlock const & block, i32 i) const { return block.planes[C][i]; }
+};
+
+struct PixelChannels
+{
+    PixelChannel<0> r;
+    PixelChannel<1> g;
+    PixelChannel<2> b;
+    PixelChannel<3> a;
+};
+constexpr PixelChannels px;
+
+struct PixelConst : PixelExprBase
+{
+    f32 value;
+    f32 eval(PixelBlock const &, i32) const { return value; }
+};
+
+template<PixelOperand T>
+auto as_pixel_expr(T t)
+{
+    if constexpr (PixelExpr<T>) return t;
+    else return PixelConst{{}, f32(t)};
+}
+
+
+///--- Operators
+
+template<typename Op, PixelExpr L, PixelExpr R>
+struct PixelBinary : PixelExprBase
+{
+    L l;
+    R r;
+    f32 eval(PixelBlock const & block, i32 i) const { return Op::apply(l.eval(block, i), r.eval(block, i)); }
+};
+
+#define PIXEL_EXPR_BINARY(Name, signature, expression)                                          \
+    struct Name { static f32 apply(f32 a, f32 b) { return expression; } };                    \
+    template<PixelOperand L, PixelOperand R> requires (PixelExpr<L> or PixelExpr<R>)          \
+    auto signature(L l, R r)                                                                    \
+    { return PixelBinary<Name, decltype(as_pixel_expr(l)), decltype(as_pixel_expr(r))>{{}, as_pixel_expr(l), as_pixel_expr(r)}; }
+
+PIXEL_EXPR_BINARY(PixelAdd, operator +, a + b)
+PIXEL_EXPR_BINARY(PixelSub, operator -, a - b)
+PIXEL_EXPR_BINARY(PixelMul, operator *, a * b)
+PIXEL_EXPR_BINARY(PixelDiv, operator /, a / b)
+PIXEL_EXPR_BINARY(PixelMin, min, a < b ? a : b)
+PIXEL_EXPR_BINARY(PixelMax, max, a > b ? a : b)
+PIXEL_EXPR_BINARY(PixelPow, pow, powf(a, b))
+// comparisons evaluate to 1 or 0
+PIXEL_EXPR_BINARY(PixelLess, operator <, f32(a < b))
+PIXEL_EXPR_BINARY(PixelGreater, operator >, f32(a > b))
+PIXEL_EXPR_BINARY(PixelLessEqual, operator <=, f32(a <= b))
+PIXEL_EXPR_BINARY(PixelGreaterEqual, operator >=, f32(a >= b))
+
+#undef PIXEL_EXPR_BINARY
+
+template<typename Op, PixelExpr E>
+struct PixelUnary : PixelExprBase
+{
+    E e;
+    f32 eval(PixelBlock const & block, i32 i) const { return Op::apply(e.eval(block, i)); }
+};
+
+#define PIXEL_EXPR_UNARY(Name, signature, expression)                                           \
+    struct Name { static f32 apply(f32 a) { return expression; } };                           \
+    template<PixelExpr E>                                                                       \
+    auto signature(E e) { return PixelUnary<Name, E>{{}, e}; }
+
+PIXEL_EXPR_UNARY(PixelNegate, operator -, -a)
+PIXEL_EXPR_UNARY(PixelAbs, abs, fabsf(a))
+PIXEL_EXPR_UNARY(PixelSaturate, saturate, a < 0 ? 0 : (a > 1 ? 1 : a))
+
+#undef PIXEL_EXPR_UNARY
+
+template<PixelOperand E, PixelOperand L, PixelOperand H> requires (PixelExpr<E> or PixelExpr<L> or PixelExpr<H>)
+auto clamp(E e, L l, H h) { return max(as_pixel_expr(l), min(as_pixel_expr(e), as_pixel_expr(h))); }
+
+
+///--- Select, LUT
+
+template<PixelExpr C, PixelExpr T, PixelExpr F>
+struct PixelSelect : PixelExprBase
+{
+    C condition;
+    T if_true;
+    F if_false;
+    f32 eval(PixelBlock const & block, i32 i) const
+    { return condition.eval(block, i) != 0 ? if_true.eval(block, i) : if_false.eval(block, i); }
+};
+
+template<PixelExpr C, PixelOperand T, PixelOperand F>
+auto select(C condition, T if_true, F if_false)
+{ return PixelSelect<C, decltype(as_pixel_expr(if_true)), decltype(as_pixel_expr(if_false))>{{}, condition, as_pixel_expr(if_true), as_pixel_expr(if_false)}; }
+
+// table must have 256 entries, the index is clamped into [0, 255]
+template<arithmetic T, PixelExpr E>
+struct PixelLut : PixelExprBase
+{
+    T const * table;
+    E e;
+    f32 eval(PixelBlock const & block, i32 i) const { return f32(table[clamp(i32(e.eval(block, i)), 0, 255)]); }
+};
+
+template<arithmetic T, PixelExpr E>
+auto lut(T const * table, E e) { return PixelLut<T, E>{{}, table, e}; }
+
+
+///--- Apply
+
+// (de)interleaving is done 4 pixels at a time with SSE2, the expressions are plain loops over the planes
+template<PixelExpr R, PixelExpr G, PixelExpr B, PixelExpr A>
+void apply_pixel_block(u32 * pixels, R const & r, G const & g, B const & b, A const & a)
+{
+    __m128i const byte_mask = _mm_set1_epi32(0xff);
+    __m128 const zero = _mm_setzero_ps();
+    __m128 const full = _mm_set1_ps(255.f);
+
+    PixelBlock in, out;
+    for (i32 i = 0; i < pixel_expr_block_size; i += 4)
+    {
+        __m128i const v = _mm_loadu_si128((__m128i const *)(pixels + i));
+        _mm_storeu_ps(in.planes[0] + i, _mm_cvtepi32_ps(_mm_and_si128(v, byte_mask)));
+        _mm_storeu_ps(in.planes[1] + i, _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 8), byte_mask)));
+        _mm_storeu_ps(in.planes[2] + i, _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 16), byte_mask)));
+        _mm_storeu_ps(in.planes[3] + i, _mm_cvtepi32_ps(_mm_srli_epi32(v, 24)));
+    }
+
+    // one loop per channel so each is a straight, vectorizable loop
+    for (i32 i = 0; i < pixel_expr_block_size; ++i) out.planes[0][i] = r.eval(in, i);
+    for (i32 i = 0; i < pixel_expr_block_size; ++i) out.planes[1][i] = g.eval(in, i);
+    for (i32 i = 0; i < pixel_expr_block_size; ++i) out.planes[2][i] = b.eval(in, i);
+    for (i32 i = 0; i < pixel_expr_block_size; ++i) out.planes[3][i] = a.eval(in, i);
+
+    for (i32 i = 0; i < pixel_expr_block_size; i += 4)
+    {
+        __m128i v = _mm_setzero_si128();
+        for (i32 c = 0; c < 4; ++c)
+        {
+            __m128 const clamped = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(out.planes[c] + i), zero), full);
+            v = _mm_or_si128(v, _mm_slli_epi32(_mm_cvtps_epi32(clamped), 8 * c));
+        }
+        _mm_storeu_si128((__m128i *)(pixels + i), v);
+    }
+}
+
+template<PixelOperand R, PixelOperand G, PixelOperand B, PixelOperand A>
+void apply(Image & image, R r, G g, B b, A a)
+{
+    auto const expr_r = as_pixel_expr(r);
+    auto const expr_g = as_pixel_expr(g);
+    auto const expr_b = as_pixel_expr(b);
+    auto const expr_a = as_pixel_expr(a);
+
+    u32 * pixels = (u32 *)image.pixels.things;
+    i32 const pixel_count = image.x * image.y;
+    i32 const block_count = pixel_count / pixel_expr_block_size;
+
+    #pragma omp parallel for schedule(static)
+    for (i32 block_idx = 0; block_idx < block_count; ++block_idx)
+        apply_pixel_block(pixels + block_idx * pixel_expr_block_size, expr_r, expr_g, expr_b, expr_a);
+
+    // the last partial block goes through a padded copy
+    if (i32 const tail_size = pixel_count % pixel_expr_block_size)
+    {
+        u32 * tail = pixels + block_count * pixel_expr_block_size;
+        u32 padded[pixel_expr_block_size] = {0};
+        memcpy(padded, tail, tail_size * sizeof(u32));
+        apply_pixel_block(padded, expr_r, expr_g, expr_b, expr_a);
+        memcpy(tail, padded, tail_size * sizeof(u32));
+    }
+}
@@ -0,0 +1,361 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <cstdlib>
+
+/* PNG encoder
+ Rows are filtered in parallel, then the filtered rows are cut into bands and each band is deflated
+ on its own thread. A band is one fixed Huffman block followed by an empty stored block (a sync flush),
+ which byte aligns it, so the bands concatenate into a single zlib stream. Back references may reach
+ into the previous band's bytes, the decoder's window is continuous, so compression barely suffers.
+ Every band is its own IDAT chunk, its CRC is computed on the same thread, Adler-32s are combined.
+*/
+
+constexpr size_t png_band_bytes = 256 << 10;
+constexpr i32 png_window_size = 1 << 15;
+constexpr i32 png_hash_bits = 15;
+constexpr i32 png_max_chain = 16;
+constexpr i32 png_min_match = 3;
+constexpr i32 png_max_match = 258;
+
+struct PngCrcTable
+{
+    u32 table[256];
+
+    constexpr PngCrcTable() : table()
+    {
+        for (u32 n = 0; n < 256; ++n)
+        {
+            u32 c = n;
+            for (i32 k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+};
+constexpr PngCrcTable png_crc_table;
+
+inline u32 png_crc(u8 const * data, size_t size, u32 crc = 0)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = png_crc_table.table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+constexpr u32 adler_base = 65521;
+
+inline u32 adler32(u8 const * data, size_t size)
+{
+    u32 a = 1, b = 0;
+    while (size > 0)
+    {
+        size_t const chunk = min<size_t>(size, 5552); // largest n that can't overflow b before the modulo
+        for (size_t i = 0; i < chunk; ++i)
+            a += data[i], b += a;
+        a %= adler_base, b %= adler_base;
+        data += chunk, size -= chunk;
+    }
+    return b << 16 | a;
+}
+
+// adler32 of A followed by B, from adler32(A), adler32(B) and B's size
+inline u32 adler32_combine(u32 adler_a, u32 adler_b, size_t size_b)
+{
+    u32 const rem = u32(size_b % adler_base);
+    u32 sum_1 = adler_a & 0xffff;
+    u32 sum_2 = u32((u64(rem) * sum_1) % adler_base);
+    sum_1 += (adler_b & 0xffff) + adler_base - 1;
+    sum_2 += (adler_a >> 16) + (adler_b >> 16) + adler_base - rem;
+    if (sum_1 >= adler_base) sum_1 -= adler_base;
+    if (sum_1 >= adler_base) sum_1 -= adler_base;
+    if (sum_2 >= adler_base * 2) sum_2 -= adler_base * 2;
+    if (sum_2 >= adler_base) sum_2 -= adler_base;
+    return sum_2 << 16 | sum_1;
+}
+
+inline void png_write_u32(u8 * out, u32 v)
+{ out[0] = u8(v >> 24), out[1] = u8(v >> 16), out[2] = u8(v >> 8), out[3] = u8(v); }
+
+
+///--- Filtering
+
+inline u8 paeth(i32 a, i32 b, i32 c)
+{
+    i32 const p = a + b - c;
+    i32 const pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb and pa <= pc) return u8(a);
+    if (pb <= pc) return u8(b);
+    return u8(c);
+}
+
+// out is 1 filter byte + the row, prev is nullptr for the first row.
+// Tries every filter and keeps the one with the smallest sum of absolute (signed) residuals.
+void png_filter_row(u8 const * row, u8 const * prev, i32 row_size, u8 * out, u8 * scratch)
+{
+    constexpr i32 bpp = 4;
+    u32 best_cost = ~0u;
+
+    // one loop per filter, predict(a, b, c) with a left, b up, c up left
+    auto const try_filter = [&](u8 filter, auto predict)
+    {
+        u8 * dst = filter == 0 ? out + 1 : scratch;
+        u32 cost = 0;
+        for (i32 i = 0; i < row_size; ++i)
+        {
+            i32 const a = i >= bpp ? row[i - bpp] : 0;
+            i32 const b = prev ? prev[i] : 0;
+            i32 const c = prev and i >= bpp ? prev[i - bpp] : 0;
+            dst[i] = u8(row[i] - predict(a, b, c));
+            cost += abs(i8(dst[i]));
+        }
+
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            out[0] = filter;
+            if (filter != 0) memcpy(out + 1, scratch, row_size);
+        }
+    };
+
+    try_filter(0, [](i32, i32, i32) { return 0; });
+    try_filter(1, [](i32 a, i32, i32) { return a; });
+    try_filter(2, [](i32, i32 b, i32) { return b; });
+    try_filter(3, [](i32 a, i32 b, i32) { return (a + b) >> 1; });
+    try_filter(4, [](i32 a, i32 b, i32 c) { return i32(paeth(a, b, c)); });
+}
+
+
+///--- Deflate
+
+struct BitWriter
+{
+    u8 * out;
+    u64 bits = 0;
+    i32 count = 0;
+
+    void add(u32 code, i32 code_bits)
+    {
+        bits |= u64(code) << count;
+        count += code_bits;
+        while (count >= 8)
+            *out++ = u8(bits), bits >>= 8, count -= 8;
+    }
+
+    // Huffman codes are stored most significant bit first
+    void add_reversed(u32 code, i32 code_bits)
+    {
+        u32 reversed = 0;
+        for (i32 i = 0; i < code_bits; ++i)
+            reversed = reversed << 1 | (code >> i & 1);
+        add(reversed, code_bits);
+    }
+
+    void align() { if (count > 0) add(0, 8 - count); }
+};
+
+inline void deflate_fixed_symbol(BitWriter & writer, i32 symbol)
+{
+    if (symbol <= 143)      writer.add_reversed(0x30 + symbol, 8);
+    else if (symbol <= 255) writer.add_reversed(0x190 + symbol - 144, 9);
+    else if (symbol <= 279) writer.add_reversed(symbol - 256, 7);
+    else                    writer.add_reversed(0xc0 + symbol - 280, 8);
+}
+
+inline void deflate_fixed_match(BitWriter & writer, i32 length, i32 distance)
+{
+    static constexpr u16 length_base[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0xffff};
+    static constexpr u8 length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static constexpr u32 distance_base[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 0xffffffff};
+    static constexpr u8 distance_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    i32 l = 0;
+    while (length >= length_base[l + 1]) ++l;
+    deflate_fixed_symbol(writer, 257 + l);
+    writer.add(length - length_base[l], length_extra[l]);
+
+    i32 d = 0;
+    while (u32(distance) >= distance_base[d + 1]) ++d;
+    writer.add_reversed(d, 5);
+    writer.add(distance - distance_base[d], distance_extra[d]);
+}
+
+inline u32 deflate_hash(u8 const * p)
+{ return ((u32(p[0]) << 16 | u32(p[1]) << 8 | p[2]) * 2654435761u) >> (32 - png_hash_bits); }
+
+// Deflates [begin, end) as a non final fixed Huffman block plus a sync flush, back references may
+// reach back to history (at most png_window_size bytes before begin). Returns the end of out,
+// out must hold deflate_max_size(end - begin) bytes.
+inline size_t deflate_max_size(size_t size) { return size * 9 / 8 + 16; }
+
+u8 * deflate_band(u8 const * history, u8 const * begin, u8 const * end, u8 * out, i32 * head, i32 * prev)
+{
+    // positions are relative to history, chains live in a ring of png_window_size
+    for (i32 i = 0; i < (1 << png_hash_bits); ++i) head[i] = -1;
+    i32 const size = i32(end - history);
+    auto const insert = [&](i32 pos)
+    {
+        u32 const h = deflate_hash(history + pos);
+        prev[pos & (png_window_size - 1)] = head[h];
+        head[h] = pos;
+    };
+
+    i32 pos = 0;
+    for (; pos < begin - history and pos + png_min_match <= size; ++pos)
+        insert(pos);
+    pos = i32(begin - history);
+
+    BitWriter writer{out};
+    writer.add(0b010, 3); // not final, fixed Huffman
+
+    while (pos < size)
+    {
+        i32 best_length = 0, best_distance = 0;
+        if (pos + png_min_match <= size)
+        {
+            i32 const max_length = min(png_max_match, size - pos);
+            i32 candidate = head[deflate_hash(history + pos)];
+            for (i32 chain = 0; chain < png_max_chain and candidate >= 0 and pos - candidate <= png_window_size; ++chain)
+            {
+                i32 length = 0;
+                while (length < max_length and history[candidate + length] == history[pos + length]) ++length;
+                if (length > best_length)
+                {
+                    best_length = length, best_distance = pos - candidate;
+                    if (length == max_length) break;
+                }
+                i32 const next = prev[candidate & (png_window_size - 1)];
+                if (next >= candidate) break; // the ring slot was reused
+                candidate = next;
+            }
+        }
+
+        if (best_length >= png_min_match)
+        {
+            deflate_fixed_match(writer, best_length, best_distance);
+            for (i32 i = 0; i < best_length; ++i, ++pos)
+                if (pos + png_min_match <= size) insert(pos);
+        }
+        else
+        {
+            deflate_fixed_symbol(writer, history[pos]);
+            if (pos + png_min_match <= size) insert(pos);
+            ++pos;
+        }
+    }
+
+    deflate_fixed_symbol(writer, 256); // end of block
+    writer.add(0b000, 3); // sync flush, an empty stored block
+    writer.align();
+    writer.add(0x0000, 16), writer.add(0xffff, 16);
+
+    return writer.out;
+}
+
+
+///--- Encode
+
+// writes the whole file, returns false if it can't be written
+bool png_write(Image const & image, const char * path, bool flip_vertically)
+{
+    i32 const row_size = image.x * 4;
+    size_t const filtered_row_size = row_size + 1;
+    size_t const filtered_size = filtered_row_size * image.y;
+
+    unique_array<u8> filtered{new u8[filtered_size]};
+    #pragma omp parallel
+    {
+        unique_array<u8> scratch{new u8[row_size]};
+
+        #pragma omp for schedule(static)
+        for (i32 y = 0; y < image.y; ++y)
+        {
+            auto const source_row = [&](i32 row) { return (u8 const *)(image.pixels.things + (flip_vertically ? image.y - 1 - row : row) * image.x); };
+            png_filter_row(source_row(y), y > 0 ? source_row(y - 1) : nullptr, row_size, filtered.things + y * filtered_row_size, scratch);
+        }
+    }
+
+    // bands are whole rows, around png_band_bytes each
+    i32 const rows_per_band = i32(max<size_t>(1, png_band_bytes / filtered_row_size));
+    i32 const band_count = (image.y + rows_per_band - 1) / rows_per_band;
+    size_t const band_capacity = 8 + deflate_max_size(rows_per_band * filtered_row_size) + 4;
+
+    struct Band { u8 * chunk; size_t size; u32 adler; size_t data_size; };
+    unique_array<Band> bands{new Band[band_count]};
+    unique_array<u8> chunks{new u8[band_capacity * band_count]};
+
+    #pragma omp parallel
+    {
+        unique_array<i32> head{new i32[1 << png_hash_bits]};
+        unique_array<i32> prev{new i32[png_window_size]};
+
+        #pragma omp for schedule(dynamic)
+        for (i32 b = 0; b < band_count; ++b)
+        {
+            size_t const begin_idx = size_t(b) * rows_per_band * filtered_row_size;
+            size_t const end_idx = min(begin_idx + rows_per_band * filtered_row_size, filtered_size);
+            u8 const * begin = filtered.things + begin_idx;
+            u8 const * end = filtered.things + end_idx;
+            u8 const * history = filtered.things + (begin_idx > png_window_size ? begin_idx - png_window_size : 0);
+
+            // chunk: length, type, data, crc
+            Band & band = bands[b];
+            band.chunk = chunks.things + b * band_capacity;
+            u8 * data = band.chunk + 8;
+            memcpy(band.chunk + 4, "IDAT", 4);
+            u8 * data_end = deflate_band(history, begin, end, data, head, prev);
+            png_write_u32(band.chunk, u32(data_end - data));
+            png_write_u32(data_end, png_crc(band.chunk + 4, data_end - data + 4));
+            band.size = data_end + 4 - band.chunk;
+            band.adler = adler32(begin, end - begin);
+            band.data_size = end - begin;
+        }
+    }
+
+    u32 adler = 1;
+    for (i32 b = 0; b < band_count; ++b)
+        adler = adler32_combine(adler, bands[b].adler, bands[b].data_size);
+
+    FILE * file = fopen(path, "wb");
+    if (not file) return false;
+
+    auto const write_chunk = [file](const char * type, u8 const * data, u32 size)
+    {
+        u8 header[8];
+        png_write_u32(header, size);
+        memcpy(header + 4, type, 4);
+        u8 crc[4];
+        png_write_u32(crc, png_crc(data, size, png_crc(header + 4, 4)));
+        fwrite(header, 8, 1, file);
+        if (size > 0) fwrite(data, 1, size, file);
+        fwrite(crc, 4, 1, file);
+    };
+
+    u8 const signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite(signature, 8, 1, file);
+
+    u8 ihdr[13];
+    png_write_u32(ihdr, image.x);
+    png_write_u32(ihdr + 4, image.y);
+    ihdr[8] = 8; // bits per channel
+    ihdr[9] = 6; // RGBA
+    ihdr[10] = ihdr[11] = ihdr[12] = 0; // deflate, adaptive filtering, no interlace
+    write_chunk("IHDR", ihdr, 13);
+
+    u8 const zlib_header[2] = {0x78, 0x01};
+    write_chunk("IDAT", zlib_header, 2);
+    for (i32 b = 0; b < band_count; ++b)
+        fwrite(bands[b].chunk, 1, bands[b].size, file);
+
+    // an empty final fixed block, then the checksum of the uncompressed (filtered) data
+    u8 zlib_end[6] = {0x03, 0x00};
+    png_write_u32(zlib_end + 2, adler);
+    write_chunk("IDAT", zlib_end, 6);
+
+    write_chunk("IEND", nullptr, 0);
+
+    bool const is_written = not ferror(file);
+    fclose(file);
+    return is_written;
+}
@@ -6,6 +6,59 @@ using f_init = void(Image const & image);
 #define EXPORTED_INIT_NAME _exported_init
 #define EXPORTED_INIT_NAME_STR "_exported_init"
 
-using f_process = void(Image & image);
+// row_begin is the row of the whole image that image starts at, when it is a band of it
+using f_process = void(Image & image, i32 row_begin);
 #define EXPORTED_PROCESS_NAME _exported_process
 #define EXPORTED_PROCESS_NAME_STR "_exported_process"
+
+
+// A process defines PROC_TRAITS (e.g. `#define PROC_TRAITS {.pointwise = true}`) to describe itself
+struct ProcessTraits
+{
+    // every pixel only depends on itself, process() may be called on any band of rows (see row_begin()).
+    // Fused stages run band by band, so init() of every fused stage sees the input of the first one,
+    // a pointwise process must not derive its state from the image in init()
+    bool pointwise = false;
+
+    // every pixel only depends on the pixels at most halo rows away, process() may be called on a band
+    // of rows padded by halo rows. -1 means the whole image is needed, pointwise processes have 0
+    i32 halo = -1;
+};
+
+using f_traits = void(ProcessTraits & traits);
+#define EXPORTED_TRAITS_NAME _exported_traits
+#define EXPORTED_TRAITS_NAME_STR "_exported_traits"
+
+// args are "name=value" pairs separated by spaces, a process reads them with param(name, fallback)
+using f_set_args = void(const char * args);
+#define EXPORTED_SET_ARGS_NAME _exported_set_args
+#define EXPORTED_SET_ARGS_NAME_STR "_exported_set_args"
+
+// allocations made through operator new/delete inside the dll, counted by process_wrapper.cpp
+struct AllocStats
+{
+    bool is_counted = false; // tuned builds don't count
+    i64 current_bytes = 0; // negative if the dll freed more than it allocated, e.g. blocks the host allocated
+    i64 peak_bytes = 0;
+    u64 count = 0;
+    u64 largest_bytes = 0;
+};
+
+// reset starts a new run, peak becomes the current bytes, count and largest become 0
+using f_alloc_stats = void(AllocStats & stats, bool reset);
+#define EXPORTED_ALLOC_STATS_NAME _exported_alloc_stats
+#define EXPORTED_ALLOC_STATS_NAME_STR "_exported_alloc_stats"
+
+f32 parse_param(const char * args, const char * name, f32 fallback)
+{
+    size_t const name_size = strlen(name);
+    for (const char * iter = args; *iter;)
+    {
+        while (*iter == ' ') ++iter;
+        if (strncmp(iter, name, name_size) == 0 and iter[name_size] == '=')
+            return strtof(iter + name_size + 1, nullptr);
+
+        while (*iter and *iter != ' ') ++iter;
+    }
+    return fallback;
+}
\ No newline at end of file
@@ -1,16 +1,171 @@
 #include "common.hpp"
 #include "process.hpp"
 
+#include <atomic>
+#include <malloc.h>
+#include <new>
+
 #ifndef PROC_PATH
 #error PROC_PATH NOT defined
 #endif
 
 
+// operator new/delete are replaced in this dll only, the host's allocations are not counted.
+// Sizes come from _msize so a block freed on the other side of the dll boundary is still safe, such a
+// block makes current_bytes go below what the dll allocated. Tuned builds (PROC_NO_ALLOC_STATS) don't count.
+//
+// Every thread counts into its own cache line and moves its bytes to the shared counters once its
+// balance changed by alloc_flush_bytes, so threads allocating in parallel loops don't contend.
+// The peak is exact to within alloc_flush_bytes per thread.
+#ifndef PROC_NO_ALLOC_STATS
+
+constexpr i64 alloc_flush_bytes = 64 << 10;
+constexpr i32 alloc_max_threads = 256; // threads past this count into the shared counters directly
+
+struct alignas(64) AllocCounters
+{
+    std::atomic<i64> bytes = 0; // the shared one has all flushed bytes, a thread's has its pending ones
+    std::atomic<u64> count = 0;
+    std::atomic<u64> largest_bytes = 0;
+};
+
+static AllocCounters alloc_shared;
+static std::atomic<i64> alloc_peak_bytes = 0;
+static AllocCounters alloc_threads[alloc_max_threads];
+static std::atomic<i32> alloc_thread_count = 0;
+static thread_local i32 alloc_thread_idx = -1;
+
+template<typename T>
+static void atomic_max(std::atomic<T> & a, T v)
+{
+    T old = a.load(std::memory_order_relaxed);
+    while (old < v and not a.compare_exchange_weak(old, v, std::memory_order_relaxed));
+}
+
+static void count_alloc(i64 bytes)
+{
+    if (alloc_thread_idx == -1)
+        alloc_thread_idx = alloc_thread_count.fetch_add(1, std::memory_order_relaxed);
+
+    if (alloc_thread_idx >= alloc_max_threads)
+    {
+        atomic_max(alloc_peak_bytes, alloc_shared.bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+        if (bytes > 0)
+            alloc_shared.count.fetch_add(1, std::memory_order_relaxed),
+            atomic_max(alloc_shared.largest_bytes, u64(bytes));
+        return;
+    }
+
+    // only this thread writes its counters, plain loads and stores are enough
+    AllocCounters & counters = alloc_threads[alloc_thread_idx];
+    i64 pending = counters.bytes.load(std::memory_order_relaxed) + bytes;
+    if (bytes > 0)
+    {
+        counters.count.store(counters.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (u64(bytes) > counters.largest_bytes.load(std::memory_order_relaxed))
+            counters.largest_bytes.store(u64(bytes), std::memory_order_relaxed);
+    }
+    if (pending >= alloc_flush_bytes or pending <= -alloc_flush_bytes)
+    {
+        atomic_max(alloc_peak_bytes, alloc_shared.bytes.fetch_add(pending, std::memory_order_relaxed) + pending);
+        pending = 0;
+    }
+    counters.bytes.store(pending, std::memory_order_relaxed);
+}
+
+void * operator new(size_t size)
+{
+    void * ptr = malloc(size == 0 ? 1 : size);
+    if (not ptr) throw std::bad_alloc();
+    count_alloc(i64(_msize(ptr)));
+    return ptr;
+}
+
+void operator delete(void * ptr) noexcept
+{
+    if (not ptr) return;
+    count_alloc(-i64(_msize(ptr)));
+    free(ptr);
+}
+
+void * operator new(size_t size, std::align_val_t align)
+{
+    void * ptr = _aligned_malloc(size == 0 ? 1 : size, size_t(align));
+    if (not ptr) throw std::bad_alloc();
+    count_alloc(i64(_aligned_msize(ptr, size_t(align), 0)));
+    return ptr;
+}
+
+void operator delete(void * ptr, std::align_val_t align) noexcept
+{
+    if (not ptr) return;
+    count_alloc(-i64(_aligned_msize(ptr, size_t(align), 0)));
+    _aligned_free(ptr);
+}
+
+void * operator new[](size_t size) { return operator new(size); }
+void operator delete[](void * ptr) noexcept { operator delete(ptr); }
+void operator delete(void * ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void * ptr, size_t) noexcept { operator delete(ptr); }
+void * operator new[](size_t size, std::align_val_t align) { return operator new(size, align); }
+void operator delete[](void * ptr, std::align_val_t align) noexcept { operator delete(ptr, align); }
+void operator delete(void * ptr, size_t, std::align_val_t align) noexcept { operator delete(ptr, align); }
+void operator delete[](void * ptr, size_t, std::align_val_t align) noexcept { operator delete(ptr, align); }
+
+static void get_alloc_stats(AllocStats & stats, bool reset)
+{
+    i32 const thread_count = min(alloc_thread_count.load(), alloc_max_threads);
+
+    i64 current = alloc_shared.bytes;
+    u64 count = alloc_shared.count;
+    u64 largest = alloc_shared.largest_bytes;
+    for (i32 i = 0; i < thread_count; ++i)
+    {
+        current += alloc_threads[i].bytes;
+        count += alloc_threads[i].count;
+        largest = max(largest, alloc_threads[i].largest_bytes.load());
+    }
+
+    stats = {.is_counted = true, .current_bytes = current, .peak_bytes = max(current, alloc_peak_bytes.load()), .count = count, .largest_bytes = largest};
+
+    // runs don't overlap a reset, nothing allocates meanwhile
+    if (reset)
+    {
+        alloc_peak_bytes = current;
+        alloc_shared.count = 0, alloc_shared.largest_bytes = 0;
+        for (i32 i = 0; i < thread_count; ++i)
+            alloc_threads[i].count = 0, alloc_threads[i].largest_bytes = 0;
+    }
+}
+
+#else
+
+static void get_alloc_stats(AllocStats & stats, bool) { stats = {}; }
+
+#endif
+
+
+static str process_args;
+f32 param(const char * name, f32 fallback) { return parse_param(process_args.c_str(), name, fallback); }
+
+// the row of the whole image that process()'s image starts at, 0 unless it runs on a band
+static thread_local i32 process_row_begin = 0;
+i32 row_begin() { return process_row_begin; }
+
+
 #include PROC_PATH
 
 
+#ifndef PROC_TRAITS
+#define PROC_TRAITS {}
+#endif
+
+
 #define EXPORT extern "C" __declspec(dllexport)
 
 // These will check for function signature and make the user code cleaner
 EXPORT void EXPORTED_INIT_NAME(Image const & image) { init(image); }
-EXPORT void EXPORTED_PROCESS_NAME(Image & image) { process(image); }
+EXPORT void EXPORTED_PROCESS_NAME(Image & image, i32 row_begin) { process_row_begin = row_begin; process(image); }
+EXPORT void EXPORTED_TRAITS_NAME(ProcessTraits & traits) { traits = ProcessTraits PROC_TRAITS; }
+EXPORT void EXPORTED_SET_ARGS_NAME(const char * args) { process_args = args; }
+EXPORT void EXPORTED_ALLOC_STATS_NAME(AllocStats & stats, bool reset) { get_alloc_stats(stats, reset); }
\ No newline at end of file
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "common.hpp"
+
+/* QOI, the Quite OK Image format
+ see https://qoiformat.org/qoi-specification.pdf
+ Lossless and an order of magnitude faster than PNG to encode and decode, files are a bit larger.
+ Images are always read/written as 4 channels, rows are top to bottom in the file.
+*/
+
+constexpr u8 qoi_op_index = 0x00;
+constexpr u8 qoi_op_diff = 0x40;
+constexpr u8 qoi_op_luma = 0x80;
+constexpr u8 qoi_op_run = 0xc0;
+constexpr u8 qoi_op_rgb = 0xfe;
+constexpr u8 qoi_op_rgba = 0xff;
+constexpr u8 qoi_mask_2 = 0xc0;
+
+constexpr i32 qoi_header_size = 14;
+constexpr u8 qoi_padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+inline u32 qoi_hash(u8x4 const & px)
+{ return (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64; }
+
+inline void qoi_write_u32(u8 * & iter, u32 v)
+{
+    *iter++ = u8(v >> 24), *iter++ = u8(v >> 16), *iter++ = u8(v >> 8), *iter++ = u8(v);
+}
+
+inline u32 qoi_read_u32(u8 const * & iter)
+{
+    u32 v = u32(iter[0]) << 24 | u32(iter[1]) << 16 | u32(iter[2]) << 8 | u32(iter[3]);
+    iter += 4;
+    return v;
+}
+
+// returns the encoded size, out must hold qoi_max_size(image) bytes
+inline size_t qoi_max_size(Image const & image)
+{ return qoi_header_size + size_t(image.x) * image.y * 5 + sizeof(qoi_padding); }
+
+size_t qoi_encode(Image const & image, bool flip_vertically, u8 * out)
+{
+    u8 * iter = out;
+    *iter++ = 'q', *iter++ = 'o', *iter++ = 'i', *iter++ = 'f';
+    qoi_write_u32(iter, image.x);
+    qoi_write_u32(iter, image.y);
+    *iter++ = 4; // channels
+    *iter++ = 0; // sRGB with linear alpha
+
+    u8x4 index[64] = {};
+    u8x4 prev = {0, 0, 0, 255};
+    i32 run = 0;
+
+    for (i32 row = 0; row < image.y; ++row)
+    {
+        u8x4 const * pixels = image.pixels.things + (flip_vertically ? image.y - 1 - row : row) * image.x;
+        bool const is_last_row = row == image.y - 1;
+
+        for (i32 x = 0; x < image.x; ++x)
+        {
+            u8x4 const & px = pixels[x];
+
+            if (memcmp(px, prev, 4) == 0)
+            {
+                run += 1;
+                if (run == 62 or (is_last_row and x == image.x - 1))
+                    *iter++ = qoi_op_run | u8(run - 1), run = 0;
+                continue;
+            }
+
+            if (run > 0)
+                *iter++ = qoi_op_run | u8(run - 1), run = 0;
+
+            u32 const hash = qoi_hash(px);
+            if (memcmp(index[hash], px, 4) == 0)
+                *iter++ = qoi_op_index | u8(hash);
+            else
+            {
+                memcpy(index[hash], px, 4);
+
+                if (px[3] == prev[3])
+                {
+                    i32 const vr = i8(px[0] - prev[0]);
+                    i32 const vg = i8(px[1] - prev[1]);
+                    i32 const vb = i8(px[2] - prev[2]);
+                    i32 const vg_r = vr - vg;
+                    i32 const vg_b = vb - vg;
+
+                    if (vr > -3 and vr < 2 and vg > -3 and vg < 2 and vb > -3 and vb < 2)
+                        *iter++ = qoi_op_diff | u8((vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                    else if (vg_r > -9 and vg_r < 8 and vg > -33 and vg < 32 and vg_b > -9 and vg_b < 8)
+                        *iter++ = qoi_op_luma | u8(vg + 32),
+                        *iter++ = u8((vg_r + 8) << 4 | (vg_b + 8));
+                    else
+                        *iter++ = qoi_op_rgb, *iter++ = px[0], *iter++ = px[1], *iter++ = px[2];
+                }
+                else
+                    *iter++ = qoi_op_rgba, *iter++ = px[0], *iter++ = px[1], *iter++ = px[2], *iter++ = px[3];
+            }
+
+            memcpy(prev, px, 4);
+        }
+    }
+
+    memcpy(iter, qoi_padding, sizeof(qoi_padding));
+    iter += sizeof(qoi_padding);
+
+    return iter - out;
+}
+
+// returns false on a malformed file, image is allocated here
+bool qoi_decode(u8 const * data, size_t size, bool flip_vertically, Image & image)
+{
+    if (size < qoi_header_size + sizeof(qoi_padding) or memcmp(data, "qoif", 4) != 0) return false;
+
+    u8 const * iter = data + 4;
+    u32 const x = qoi_read_u32(iter);
+    u32 const y = qoi_read_u32(iter);
+    iter += 2; // channels and colorspace don't change how the stream is decoded
+    if (x == 0 or y == 0 or u64(x) * y > (u64(1) << 30)) return false;
+
+    image = Image(i32(x), i32(y), nullptr);
+
+    u8 const * const chunks_end = data + size - sizeof(qoi_padding);
+    u8x4 index[64] = {};
+    u8x4 px = {0, 0, 0, 255};
+    i32 run = 0;
+
+    for (i32 row = 0; row < image.y; ++row)
+    {
+        u8x4 * pixels = image.pixels.things + (flip_vertically ? image.y - 1 - row : row) * image.x;
+
+        for (i32 i = 0; i < image.x; ++i)
+        {
+            if (run > 0)
+                run -= 1;
+            else if (iter < chunks_end)
+            {
+                u8 const b1 = *iter++;
+
+                if (b1 == qoi_op_rgb)
+                    px[0] = *iter++, px[1] = *iter++, px[2] = *iter++;
+                else if (b1 == qoi_op_rgba)
+                    px[0] = *iter++, px[1] = *iter++, px[2] = *iter++, px[3] = *iter++;
+                else if ((b1 & qoi_mask_2) == qoi_op_index)
+                    memcpy(px, index[b1], 4);
+                else if ((b1 & qoi_mask_2) == qoi_op_diff)
+                {
+                    px[0] += ((b1 >> 4) & 0x03) - 2;
+                    px[1] += ((b1 >> 2) & 0x03) - 2;
+                    px[2] += (b1 & 0x03) - 2;
+                }
+                else if ((b1 & qoi_mask_2) == qoi_op_luma)
+                {
+                    u8 const b2 = *iter++;
+                    i32 const vg = (b1 & 0x3f) - 32;
+                    px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+                    px[1] += vg;
+                    px[2] += vg - 8 + (b2 & 0x0f);
+                }
+                else // qoi_op_run
+                    run = b1 & 0x3f;
+
+                memcpy(index[qoi_hash(px)], px, 4);
+            }
+
+            memcpy(pixels[i], px, 4);
+        }
+    }
+
+    return true;
+}